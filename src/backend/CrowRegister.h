@@ -3,5 +3,6 @@
 
 void CrowPing();
 void CrowIntAlertSSE();
+void CrowStreamStop();
 
 #endif //REGISTER_H
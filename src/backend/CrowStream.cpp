@@ -18,82 +18,540 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
 #include "nlohmann/json.hpp"
 #include "instance.h"
 #include "helper/log.h"
+#include "helper/ThreadPool.h"
+#include "core/g_global_config_t.h"
 #include "CrowRegister.h"
 #include "file_access.h"
-#include "helper/base64.hpp"
+#include "core/base64.h"
+#include "stream_protocol.h"
 
 using namespace std::literals;
 using json = nlohmann::json;
 
-void CrowIntAlertSSE()
+static std::unique_ptr<ThreadPool> stream_workers;
+static std::atomic < unsigned > max_inflight = 64;
+static std::atomic < uint64_t > max_queued = 64 * 1024 * 1024;
+
+/* Block I/O and compression never run on Crow's network threads. Requests on one connection are
+ * handed to the stream worker pool and answered as soon as each finishes, clients match answers to
+ * requests by their id ("Id" in JSON, request_id in binary frames).
+ * At most max_inflight requests of one connection occupy workers at a time, the rest wait in the
+ * session so a single busy client cannot starve the others. Waiting requests are copies, so their
+ * size is capped at max_queued bytes per connection, requests beyond it are refused with an error.
+ * Workers may finish after the connection is gone, so they only reach it through the session,
+ * which onclose detaches under the same lock. */
+class stream_session_t : public std::enable_shared_from_this<stream_session_t>
 {
-    // Define a route that streams data
-    CROW_WEBSOCKET_ROUTE(backend_instance, "/stream")
-        .onopen([&](crow::websocket::connection &conn) {
-            CROW_LOG_INFO << "[/Stream] New websocket connection from " << conn.get_remote_ip();
-        })
+    std::mutex mutex_;
+    crow::websocket::connection * conn_;
 
-        .onclose([&](crow::websocket::connection &, const std::string &, short unsigned int) {
-            CROW_LOG_INFO << "[/Stream] Websocket connection closed";
-        })
+    std::mutex queue_mutex_;
+    struct pending_t
+    {
+        std::function<void()> job;
+        size_t size;
+    };
 
-        .onmessage([&](crow::websocket::connection &conn, const std::string & request, const bool is_binary)
+    std::deque < pending_t > pending_;
+    uint64_t pending_bytes_ = 0;
+    unsigned inflight_ = 0;
+
+    void run(std::function<void()> job)
+    {
+        stream_workers->post([self = shared_from_this(), job = std::move(job)]() mutable
         {
-            auto send_data = [&](const std::string &data)
+            try {
+                job();
+            } catch (const std::exception & e) {
+                warning_log("[/Stream] Uncaught exception: ", e.what());
+            }
+
+            // hand the worker slot to the next queued request of this connection
+            std::function<void()> next;
             {
-                if (is_binary) {
-                    conn.send_binary(data);
-                } else {
-                    conn.send_text(data);
+                std::lock_guard lock(self->queue_mutex_);
+                if (self->pending_.empty()) {
+                    self->inflight_--;
+                    return;
                 }
-            };
 
-            json response;
-            try {
-                json data = json::parse(request);
-                const std::string operation = data["Request"];
-                debug_log("WebSocket request: " + operation);
-                if (operation == "read") { }
-                else if (operation == "write") {}
-                else if (operation == "query_block")
+                next = std::move(self->pending_.front().job);
+                self->pending_bytes_ -= self->pending_.front().size;
+                self->pending_.pop_front();
+            }
+
+            self->run(std::move(next));
+        });
+    }
+
+public:
+    const stream_version_t version;     // binary protocol negotiated on connect
+
+    stream_session_t(crow::websocket::connection & conn, const stream_version_t version)
+        : conn_(&conn), version(version) { }
+
+    /// returns false without taking the job if size more bytes would overflow the queue
+    bool submit(std::function<void()> job, const size_t size)
+    {
+        {
+            std::lock_guard lock(queue_mutex_);
+            if (inflight_ >= max_inflight.load(std::memory_order_relaxed))
+            {
+                // one request always fits, however large
+                if (!pending_.empty() && pending_bytes_ + size > max_queued.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+
+                pending_.push_back({ .job = std::move(job), .size = size });
+                pending_bytes_ += size;
+                return true;
+            }
+
+            inflight_++;
+        }
+
+        run(std::move(job));
+        return true;
+    }
+
+    void send(std::string message, const bool is_binary)
+    {
+        std::lock_guard lock(mutex_);
+        if (!conn_) {
+            return;
+        }
+
+        if (is_binary) {
+            conn_->send_binary(std::move(message));
+        } else {
+            conn_->send_text(std::move(message));
+        }
+    }
+
+    void close(const std::string & message, const uint16_t code)
+    {
+        std::lock_guard lock(mutex_);
+        if (conn_) {
+            conn_->close(message, code);
+        }
+    }
+
+    void detach()
+    {
+        std::lock_guard lock(mutex_);
+        conn_ = nullptr;
+    }
+};
+
+using stream_session_ptr = std::shared_ptr<stream_session_t>;
+
+// copy a received block into a pooled buffer, zero padded up to BLOCK_SIZE unless the client sends chunks
+static directory_t::block_t make_block(const std::string_view content, const stream_version_t version = STREAM_V2)
+{
+    if (content.size() > BLOCK_SIZE) {
+        throw std::runtime_error("Block too large");
+    }
+
+    if (version == STREAM_V3)
+    {
+        // length 0 marks a missing block in query_blocks answers
+        if (content.empty()) {
+            throw std::runtime_error("Empty block");
+        }
+
+        auto block = block_buffer_t::allocate(static_cast<uint32_t>(content.size()));
+        std::memcpy(block.data(), content.data(), content.size());
+        return block;
+    }
+
+    auto block = block_buffer_t::allocate();
+    std::memcpy(block.data(), content.data(), content.size());
+    std::memset(block.data() + content.size(), 0, BLOCK_SIZE - content.size());
+    return block;
+}
+
+// decode a base64 block from the JSON protocol straight into a pooled buffer
+static directory_t::block_t make_block_from_base64(const std::string_view text)
+{
+    if (base64::decoded_size(text) > BLOCK_SIZE) {
+        throw std::runtime_error("Block too large");
+    }
+
+    auto block = block_buffer_t::allocate();
+    const size_t size = base64::decode(text, block.data(), BLOCK_SIZE);
+    std::memset(block.data() + size, 0, BLOCK_SIZE - size);
+    return block;
+}
+
+static void check_batch_size(const size_t count)
+{
+    if (count > STREAM_MAX_BATCH) {
+        throw std::invalid_argument("Batch too large: " + std::to_string(count) + " blocks");
+    }
+}
+
+// keys packed back to back, as sent by query_blocks and have_blocks
+static std::vector < block_key_t > unpack_keys(const std::string_view payload, const stream_version_t version)
+{
+    const size_t key_size = stream_key_size(version);
+    if (payload.size() % key_size != 0) {
+        throw std::invalid_argument("Malformed key list");
+    }
+
+    std::vector < block_key_t > keys(payload.size() / key_size);
+    check_batch_size(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        std::memcpy(&keys[i], payload.data() + i * key_size, key_size);
+    }
+
+    return keys;
+}
+
+// binary protocol, see stream_protocol.h
+static void on_binary_message(stream_session_t & session, const std::string & request)
+{
+    const stream_version_t version = session.version;
+    // v1 clients can only address CRC64 keys, so that is what their blocks are stored under
+    const auto store = [version](const directory_t::block_t & block) {
+        return version == STREAM_V1 ? store_block_on_my_end(block, BLOCK_HASH_CRC64) : store_block_on_my_end(block);
+    };
+
+    stream_header_t header{};
+    std::string_view payload;
+    try
+    {
+        if (!stream_decode(request, version, header, payload)) {
+            throw std::invalid_argument("Malformed binary frame");
+        }
+
+        stream_header_t response { .opcode = header.opcode, .status = STREAM_STATUS_SUCCESS, .reserved = 0,
+            .request_id = header.request_id, .key = header.key, .length = 0, .reserved2 = 0 };
+        switch (header.opcode)
+        {
+            case STREAM_QUERY_BLOCK:
+            {
+                const auto block = get_block_on_my_end(header.key);
+                session.send(stream_encode(response, version, block.view()), true);
+                break;
+            }
+
+            case STREAM_DUMP_BLOCK:
+            {
+                response.key = store(make_block(payload, version));
+                session.send(stream_encode(response, version), true);
+                break;
+            }
+
+            case STREAM_QUERY_BLOCKS:
+            {
+                std::string content;
+                for (const auto & block : get_blocks_on_my_end(unpack_keys(payload, version)))
                 {
-                    const std::string path = data["Path"];
-                    const auto block = get_block_on_my_end(path);
-                    const std::string content = {block.begin(), block.end()};
-                    response["Result"] = "Success";
-                    response["Error"] = "";
-                    response["Content"] = base64::to_base64(content);
-                    send_data(response.dump());
+                    const uint32_t length = block.size();       // 0 marks a missing block
+                    content.append(reinterpret_cast<const char *>(&length), sizeof(length));
+                    if (block) {
+                        content.append(block.view());
+                    }
                 }
-                else if (operation == "dump_block")
+
+                session.send(stream_encode(response, version, content), true);
+                break;
+            }
+
+            case STREAM_DUMP_BLOCKS:
+            {
+                // the whole list is checked before the first store, a bad tail leaves no references behind
+                std::vector < directory_t::block_t > blocks;
+                for (size_t offset = 0; offset < payload.size();)
                 {
-                    const std::string content_base64 = data["Content"];
-                    const std::string content = base64::from_base64(content_base64);
-                    if (content.size() > BLOCK_SIZE) {
-                        throw std::runtime_error("Block too large");
+                    uint32_t length;
+                    if (payload.size() - offset < sizeof(length)) {
+                        throw std::invalid_argument("Malformed block list");
                     }
-                    std::array<char, BLOCK_SIZE> remote_content{};
-                    std::memcpy(remote_content.data(), content.c_str(), std::min(static_cast<uint64_t>(BLOCK_SIZE), content.size()));
-                    response["Content"] = write_block_on_my_end(remote_content);
-                    response["Result"] = "Success";
-                    response["Error"] = "";
-                    send_data(response.dump());
+
+                    std::memcpy(&length, payload.data() + offset, sizeof(length));
+                    offset += sizeof(length);
+                    if (payload.size() - offset < length) {
+                        throw std::invalid_argument("Malformed block list");
+                    }
+
+                    check_batch_size(blocks.size() + 1);
+                    blocks.push_back(make_block(payload.substr(offset, length), version));
+                    offset += length;
+                }
+
+                std::string keys;
+                for (const auto & block : blocks) {
+                    stream_append_key(keys, store(block), version);
                 }
-                else if (operation == "close") {
-                    conn.close("Client requested close", 1000);
+
+                session.send(stream_encode(response, version, keys), true);
+                break;
+            }
+
+            case STREAM_HAVE_BLOCKS:
+            {
+                const auto keys = unpack_keys(payload, version);
+                std::vector < bool > present(keys.size());
+                for (size_t i = 0; i < keys.size(); i++) {
+                    present[i] = if_exists(keys[i]);
+                }
+
+                session.send(stream_encode(response, version, stream_bitmap(present)), true);
+                break;
+            }
+
+            case STREAM_RELEASE_BLOCKS:
+            {
+                const auto keys = unpack_keys(payload, version);
+                std::vector < bool > released(keys.size());
+                for (size_t i = 0; i < keys.size(); i++) {
+                    released[i] = release_block_on_my_end(keys[i]);
                 }
-                else {
-                    throw std::invalid_argument("Unknown operation: " + operation);
+
+                session.send(stream_encode(response, version, stream_bitmap(released)), true);
+                break;
+            }
+
+            case STREAM_CLOSE:
+                session.close("Client requested close", 1000);
+                break;
+
+            default:
+                throw std::invalid_argument("Unknown opcode: " + std::to_string(header.opcode));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        CROW_LOG_WARNING << "[/Stream] ERROR: " << e.what() << "\n";
+        const stream_header_t response { .opcode = header.opcode, .status = STREAM_STATUS_ERROR, .reserved = 0,
+            .request_id = header.request_id, .key = header.key, .length = 0, .reserved2 = 0 };
+        session.send(stream_encode(response, version, e.what()), true);
+    }
+}
+
+static void on_json_message(stream_session_t & session, const std::string & request, const bool is_binary)
+{
+    json response;
+    try {
+        json data = json::parse(request);
+        if (data.contains("Id")) {
+            response["Id"] = data["Id"];
+        }
+
+        const std::string operation = data["Request"];
+        debug_log("WebSocket request: " + operation);
+        if (operation == "read") { }
+        else if (operation == "write") {}
+        else if (operation == "query_block")
+        {
+            const std::string path = data["Path"];
+            const auto block = get_block_on_my_end(path);
+            response["Result"] = "Success";
+            response["Error"] = "";
+            response["Content"] = base64::encode(block.view());
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "dump_block")
+        {
+            const auto & content_base64 = data["Content"].get_ref<const std::string &>();
+            response["Content"] = write_block_on_my_end(make_block_from_base64(content_base64));
+            response["Result"] = "Success";
+            response["Error"] = "";
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "query_blocks")
+        {
+            // "Content" holds one base64 block per path, empty for missing blocks
+            const std::vector < std::string > paths = data["Paths"];
+            check_batch_size(paths.size());
+            std::vector < block_key_t > keys;
+            std::vector < size_t > valid;
+            for (size_t i = 0; i < paths.size(); i++) {
+                if (block_key_t key; block_name_to_key(paths[i], key)) {
+                    keys.push_back(key);
+                    valid.push_back(i);
                 }
-            } catch (const std::exception &e) {
-                CROW_LOG_WARNING << "[/Stream] ERROR: " << e.what() << "\n";
-                response["Result"] = "Error";
-                response["Error"] = e.what();
-                response["Content"] = "";
-                send_data(response.dump());
+            }
+
+            json contents = std::vector < std::string > (paths.size());
+            const auto blocks = get_blocks_on_my_end(keys);
+            for (size_t i = 0; i < valid.size(); i++) {
+                if (blocks[i]) contents[valid[i]] = base64::encode(blocks[i].view());
+            }
+
+            response["Result"] = "Success";
+            response["Error"] = "";
+            response["Content"] = std::move(contents);
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "dump_blocks")
+        {
+            // "Content" holds the name of every stored block, in request order
+            const auto & blocks = data["Contents"].get_ref<const json::array_t &>();
+            check_batch_size(blocks.size());
+            std::vector < directory_t::block_t > decoded;
+            for (const auto & content_base64 : blocks) {
+                decoded.push_back(make_block_from_base64(content_base64.get_ref<const std::string &>()));
+            }
+
+            json names = json::array();
+            for (const auto & block : decoded) {
+                names.push_back(write_block_on_my_end(block));
+            }
+
+            response["Result"] = "Success";
+            response["Error"] = "";
+            response["Content"] = std::move(names);
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "have_blocks")
+        {
+            // "Content" is the base64 presence bitmap, same layout as the binary protocol
+            const std::vector < std::string > paths = data["Paths"];
+            check_batch_size(paths.size());
+            std::vector < bool > present(paths.size());
+            for (size_t i = 0; i < paths.size(); i++) {
+                present[i] = if_exists(paths[i]);
+            }
+
+            response["Result"] = "Success";
+            response["Error"] = "";
+            response["Content"] = base64::encode(stream_bitmap(present));
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "release_blocks")
+        {
+            // "Content" is the base64 bitmap of the paths that had a reference to release
+            const std::vector < std::string > paths = data["Paths"];
+            check_batch_size(paths.size());
+            std::vector < bool > released(paths.size());
+            for (size_t i = 0; i < paths.size(); i++) {
+                released[i] = release_block_on_my_end(paths[i]);
+            }
+
+            response["Result"] = "Success";
+            response["Error"] = "";
+            response["Content"] = base64::encode(stream_bitmap(released));
+            session.send(response.dump(), is_binary);
+        }
+        else if (operation == "close") {
+            session.close("Client requested close", 1000);
+        }
+        else {
+            throw std::invalid_argument("Unknown operation: " + operation);
+        }
+    } catch (const std::exception &e) {
+        CROW_LOG_WARNING << "[/Stream] ERROR: " << e.what() << "\n";
+        response["Result"] = "Error";
+        response["Error"] = e.what();
+        response["Content"] = "";
+        session.send(response.dump(), is_binary);
+    }
+}
+
+static constexpr auto queue_full = "Too many queued requests on this connection";
+
+// answered on the network thread, the request never reaches a worker
+static void refuse_binary_message(stream_session_t & session, const std::string & request)
+{
+    stream_header_t header{};
+    std::string_view payload;
+    if (!stream_decode(request, session.version, header, payload)) {
+        header = { };
+    }
+
+    CROW_LOG_WARNING << "[/Stream] ERROR: " << queue_full << "\n";
+    const stream_header_t response { .opcode = header.opcode, .status = STREAM_STATUS_ERROR, .reserved = 0,
+        .request_id = header.request_id, .key = header.key, .length = 0, .reserved2 = 0 };
+    session.send(stream_encode(response, session.version, queue_full), true);
+}
+
+static void refuse_json_message(stream_session_t & session, const std::string & request, const bool is_binary)
+{
+    json response;
+    if (const json data = json::parse(request, nullptr, false); data.is_object() && data.contains("Id")) {
+        response["Id"] = data["Id"];
+    }
+
+    CROW_LOG_WARNING << "[/Stream] ERROR: " << queue_full << "\n";
+    response["Result"] = "Error";
+    response["Error"] = queue_full;
+    response["Content"] = "";
+    session.send(response.dump(), is_binary);
+}
+
+void CrowIntAlertSSE()
+{
+    // block I/O and compression pool, sized apart from Crow's network threads
+    const auto config = g_global_config.snapshot();
+    max_inflight = config->server.max_inflight;
+    max_queued = config->server.max_queued;
+    stream_workers = std::make_unique<ThreadPool>(config->server.io_threads, "StreamIO");
+    g_global_config.on_reload([](const config_snapshot_t & before, const config_snapshot_t & after)
+    {
+        if (after.server.io_threads != before.server.io_threads) {
+            stream_workers->resize(after.server.io_threads);
+        }
+
+        max_inflight = after.server.max_inflight;
+        max_queued = after.server.max_queued;
+    });
+
+    // Define a route that streams data
+    CROW_WEBSOCKET_ROUTE(backend_instance, "/stream")
+        .subprotocols({ STREAM_BINARY_PROTOCOL_V3, STREAM_BINARY_PROTOCOL, STREAM_BINARY_PROTOCOL_V1 })
+        .onopen([&](crow::websocket::connection &conn) {
+            const bool binary = !conn.get_subprotocol().empty();
+            const std::string subprotocol = conn.get_subprotocol();
+            const stream_version_t version = subprotocol == STREAM_BINARY_PROTOCOL_V1 ? STREAM_V1
+                : subprotocol == STREAM_BINARY_PROTOCOL_V3 ? STREAM_V3 : STREAM_V2;
+            CROW_LOG_INFO << "[/Stream] New websocket connection from " << conn.get_remote_ip()
+                          << (binary ? " (binary protocol v" + std::to_string(version) + ")" : "");
+            conn.userdata(new stream_session_ptr(std::make_shared<stream_session_t>(conn, version)));
+        })
+
+        .onclose([&](crow::websocket::connection &conn, const std::string &, short unsigned int) {
+            CROW_LOG_INFO << "[/Stream] Websocket connection closed";
+            if (const auto session = static_cast<stream_session_ptr *>(conn.userdata()))
+            {
+                (*session)->detach();
+                delete session;
+                conn.userdata(nullptr);
+            }
+        })
+
+        .onmessage([&](crow::websocket::connection &conn, const std::string & request, const bool is_binary)
+        {
+            const auto session = static_cast<stream_session_ptr *>(conn.userdata());
+            if (!session) {
+                return;
+            }
+
+            // crow reuses the message buffer once we return, so the job keeps its own copy
+            stream_session_t & target = **session;
+            if (is_binary && !conn.get_subprotocol().empty())
+            {
+                if (!target.submit([&target, request]() { on_binary_message(target, request); }, request.size())) {
+                    refuse_binary_message(target, request);
+                }
+            }
+            else if (!target.submit([&target, request, is_binary]() { on_json_message(target, request, is_binary); }, request.size())) {
+                refuse_json_message(target, request, is_binary);
             }
         });
 }
+
+void CrowStreamStop()
+{
+    if (stream_workers) {
+        stream_workers->stop();
+    }
+}
@@ -0,0 +1,129 @@
+/* block_collector.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <chrono>
+#include <thread>
+#include <linux/ioprio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "block_collector.h"
+#include "segment_store.h"
+#include "core/cache.h"
+#include "helper/log.h"
+
+block_collector_t g_block_collector;
+
+using namespace std::chrono_literals;
+
+void block_collector_t::configure(const uint64_t interval, const uint64_t bandwidth)
+{
+    interval_ = interval;
+    bandwidth_ = bandwidth;
+}
+
+void block_collector_t::pass(const std::atomic < bool > & running)
+{
+    const auto usage = g_segment_store.usage();
+    uint64_t reclaimed = 0, dropped = 0;
+
+    // the last segment is the one being appended to
+    for (uint32_t id = 0; id + 1 < usage.size() && running; id++)
+    {
+        if (usage[id].size == 0 || usage[id].live * 100 > usage[id].size * (100 - garbage_percent)) {
+            continue;
+        }
+
+        // token bucket, the copy never runs ahead of bandwidth
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t copied = 0;
+        const auto pace = [&](const uint64_t bytes)
+        {
+            copied += bytes;
+            while (running)
+            {
+                const uint64_t bandwidth = bandwidth_.load(std::memory_order_relaxed);
+                if (bandwidth == 0) {
+                    return false;
+                }
+
+                const auto due = start + std::chrono::microseconds(copied * 1000000 / bandwidth);
+                const auto now = std::chrono::steady_clock::now();
+                if (now >= due) {
+                    return true;
+                }
+
+                std::this_thread::sleep_for(std::min < std::chrono::steady_clock::duration > (due - now, 100ms));
+            }
+
+            return false;
+        };
+
+        try
+        {
+            const auto gone = g_segment_store.compact(id, pace);
+            for (const auto & key : gone) {
+                g_block_cache.erase(key);
+            }
+
+            dropped += gone.size();
+            if (running && bandwidth_.load(std::memory_order_relaxed) != 0) {
+                reclaimed += usage[id].size - std::min(copied, usage[id].size);    // the segment is empty now
+            }
+        }
+        catch (const std::exception & e)
+        {
+            warning_log("Cannot compact segment ", id, ": ", e.what());
+        }
+    }
+
+    if (dropped != 0 || reclaimed != 0) {
+        verbose_log("Block collector dropped ", dropped, " blocks and reclaimed ", reclaimed / 1024, "KB");
+    }
+
+    try {
+        g_segment_store.compact_references();
+    } catch (const std::exception & e) {
+        warning_log("Cannot rewrite reference journal: ", e.what());
+    }
+}
+
+void block_collector_t::collect(std::atomic < bool > & running)
+{
+    pthread_setname_np(pthread_self(), "BlockGC");
+    // only what the foreground leaves over, CPU and disk
+    setpriority(PRIO_PROCESS, static_cast<id_t>(gettid()), 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+    auto last = std::chrono::steady_clock::now();
+    while (running)
+    {
+        std::this_thread::sleep_for(100ms);
+        const uint64_t interval = interval_.load(std::memory_order_relaxed);
+        if (interval == 0 || bandwidth_.load(std::memory_order_relaxed) == 0
+            || std::chrono::steady_clock::now() - last < std::chrono::seconds(interval))
+        {
+            continue;
+        }
+
+        pass(running);
+        last = std::chrono::steady_clock::now();
+    }
+}
@@ -0,0 +1,55 @@
+/* block_collector.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef BLOCK_COLLECTOR_H
+#define BLOCK_COLLECTOR_H
+
+#include <atomic>
+#include <cstdint>
+#include "helper/WorkerThread.h"
+
+/* Background reclamation of unreferenced blocks.
+ * Every interval the collector looks for sealed segments that are mostly garbage (unreferenced
+ * blocks and stale copies) and compacts them, copying at most bandwidth bytes per second so that
+ * foreground reads and writes keep the disk, then rewrites the reference journal if it has grown.
+ * It runs at idle CPU and I/O priority. */
+extern
+class block_collector_t {
+    static constexpr uint64_t garbage_percent = 50;     // compact a segment once this much of it is garbage
+
+    std::atomic < uint64_t > interval_ { 0 };           // seconds between passes, 0 pauses collection
+    std::atomic < uint64_t > bandwidth_ { 0 };          // bytes per second, 0 pauses collection
+    WorkerThread worker_ { this, &block_collector_t::collect };
+
+    void collect(std::atomic < bool > & running);
+    void pass(const std::atomic < bool > & running);
+
+public:
+    block_collector_t() = default;
+    block_collector_t(const block_collector_t &) = delete;
+    block_collector_t & operator=(const block_collector_t &) = delete;
+
+    /// a new interval counts from the last pass, a new bandwidth applies to a running pass as well
+    void configure(uint64_t interval, uint64_t bandwidth);
+    void start() { worker_.start(); }
+    void stop() { worker_.stop(); }
+} g_block_collector;
+
+#endif //BLOCK_COLLECTOR_H
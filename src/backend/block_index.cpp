@@ -0,0 +1,267 @@
+/* block_index.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <bit>
+#include <mutex>
+#include "block_index.h"
+
+block_index_t::block_index_t()
+{
+    for (auto & shard : shards_) {
+        shard.slots.resize(initial_capacity);
+    }
+}
+
+uint64_t block_index_t::mix(const block_key_t & block_key)
+{
+    // murmur3 finalizer, spreads keys over both the shard bits and the slot bits
+    uint64_t key = block_key.lo ^ (block_key.hi * 0x9E3779B97F4A7C15ULL);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void block_index_t::rehash(shard_t & shard, const size_t capacity)
+{
+    std::vector < slot_t > slots(capacity);
+    const size_t mask = capacity - 1;
+    for (const auto & slot : shard.slots)
+    {
+        if (slot.location.length == 0) {
+            continue;
+        }
+
+        size_t i = mix(slot.key) & mask;
+        while (slots[i].location.length != 0) {
+            i = (i + 1) & mask;
+        }
+
+        slots[i] = slot;
+    }
+
+    shard.slots = std::move(slots);
+}
+
+bool block_index_t::find(const block_key_t & key, block_location_t & location) const
+{
+    const uint64_t hash = mix(key);
+    const shard_t & shard = shards_[hash >> (64 - shard_bits)];
+    std::shared_lock lock(shard.mutex);
+    const size_t mask = shard.slots.size() - 1;
+    for (size_t i = hash & mask; shard.slots[i].location.length != 0; i = (i + 1) & mask)
+    {
+        if (shard.slots[i].key == key) {
+            location = shard.slots[i].location;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool block_index_t::contains(const block_key_t & key) const
+{
+    block_location_t location{};
+    return find(key, location);
+}
+
+block_index_t::slot_t * block_index_t::locate(shard_t & shard, const uint64_t hash, const block_key_t & key)
+{
+    const size_t mask = shard.slots.size() - 1;
+    for (size_t i = hash & mask; shard.slots[i].location.length != 0; i = (i + 1) & mask)
+    {
+        if (shard.slots[i].key == key) {
+            return &shard.slots[i];
+        }
+    }
+
+    return nullptr;
+}
+
+static bool same_place(const block_location_t & a, const block_location_t & b)
+{
+    return a.segment == b.segment && a.offset == b.offset;
+}
+
+bool block_index_t::insert(const block_key_t & key, const block_location_t & location)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+
+    // keep load factor under 3/4 so probe sequences stay short
+    if ((shard.size + 1) * 4 > shard.slots.size() * 3) {
+        rehash(shard, shard.slots.size() * 2);
+    }
+
+    const size_t mask = shard.slots.size() - 1;
+    size_t i = hash & mask;
+    for (; shard.slots[i].location.length != 0; i = (i + 1) & mask)
+    {
+        if (shard.slots[i].key == key) {
+            return false;
+        }
+    }
+
+    shard.slots[i] = { .key = key, .location = location, .references = 1 };
+    shard.size++;
+    return true;
+}
+
+bool block_index_t::reference(const block_key_t & key)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+    slot_t * slot = locate(shard, hash, key);
+    if (!slot) {
+        return false;
+    }
+
+    // saturates, a block this popular is never collected anyway
+    if (slot->references != UINT32_MAX) {
+        slot->references++;
+    }
+
+    return true;
+}
+
+bool block_index_t::release(const block_key_t & key)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+    slot_t * slot = locate(shard, hash, key);
+    if (!slot || slot->references == 0) {
+        return false;
+    }
+
+    // a saturated count has lost track of its releases, it stays
+    if (slot->references != UINT32_MAX) {
+        slot->references--;
+    }
+
+    return true;
+}
+
+void block_index_t::restore(const block_key_t & key, const uint32_t references)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+    if (slot_t * slot = locate(shard, hash, key)) {
+        slot->references = references;
+    }
+}
+
+uint32_t block_index_t::references(const block_key_t & key) const
+{
+    const uint64_t hash = mix(key);
+    const shard_t & shard = shards_[hash >> (64 - shard_bits)];
+    std::shared_lock lock(shard.mutex);
+    const size_t mask = shard.slots.size() - 1;
+    for (size_t i = hash & mask; shard.slots[i].location.length != 0; i = (i + 1) & mask)
+    {
+        if (shard.slots[i].key == key) {
+            return shard.slots[i].references;
+        }
+    }
+
+    return 0;
+}
+
+bool block_index_t::relocate(const block_key_t & key, const block_location_t & from, const block_location_t & to)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+    slot_t * slot = locate(shard, hash, key);
+    if (!slot || !same_place(slot->location, from)) {
+        return false;
+    }
+
+    slot->location = to;
+    return true;
+}
+
+bool block_index_t::erase_unreferenced(const block_key_t & key, const block_location_t & location)
+{
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::unique_lock lock(shard.mutex);
+    slot_t * slot = locate(shard, hash, key);
+    if (!slot || slot->references != 0 || !same_place(slot->location, location)) {
+        return false;
+    }
+
+    // backward shift deletion, pull later entries of the probe sequence into the hole
+    const size_t mask = shard.slots.size() - 1;
+    size_t hole = slot - shard.slots.data();
+    for (size_t i = (hole + 1) & mask; shard.slots[i].location.length != 0; i = (i + 1) & mask)
+    {
+        const size_t home = mix(shard.slots[i].key) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            shard.slots[hole] = shard.slots[i];
+            hole = i;
+        }
+    }
+
+    shard.slots[hole] = slot_t{};
+    shard.size--;
+    return true;
+}
+
+void block_index_t::reserve(const size_t blocks)
+{
+    const size_t per_shard = std::bit_ceil(blocks / shards_.size() * 4 / 3 + 1);
+    for (auto & shard : shards_)
+    {
+        std::unique_lock lock(shard.mutex);
+        if (per_shard > shard.slots.size()) {
+            rehash(shard, per_shard);
+        }
+    }
+}
+
+size_t block_index_t::size() const
+{
+    size_t size = 0;
+    for (const auto & shard : shards_)
+    {
+        std::shared_lock lock(shard.mutex);
+        size += shard.size;
+    }
+
+    return size;
+}
+
+void block_index_t::clear()
+{
+    for (auto & shard : shards_)
+    {
+        std::unique_lock lock(shard.mutex);
+        shard.slots.assign(initial_capacity, slot_t{});
+        shard.size = 0;
+    }
+}
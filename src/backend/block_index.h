@@ -0,0 +1,106 @@
+/* block_index.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <shared_mutex>
+#include "core/block_key.h"
+
+struct block_location_t
+{
+    uint32_t segment;   // segment id
+    uint32_t length;    // payload length, never 0 for a stored block
+    uint64_t offset;    // payload offset inside the segment
+};
+
+/* Open-addressed (linear probing) hash index of stored blocks, keyed by the block hash.
+ * The table is split into shards by the high bits of the hash so inserts during the parallel
+ * startup scan and lookups from worker threads rarely meet on the same lock. */
+class block_index_t {
+    static constexpr unsigned shard_bits = 6;
+    static constexpr size_t initial_capacity = 1024;
+
+    struct slot_t
+    {
+        block_key_t key;
+        block_location_t location;  // location.length == 0 marks an empty slot
+        uint32_t references;        // stores of the block, every write of a stored block adds one
+    };
+
+    struct alignas(64) shard_t
+    {
+        mutable std::shared_mutex mutex;
+        std::vector < slot_t > slots;
+        size_t size = 0;
+    };
+
+    std::array < shard_t, 1 << shard_bits > shards_;
+
+    static uint64_t mix(const block_key_t & key);
+    static void rehash(shard_t & shard, size_t capacity);
+    static slot_t * locate(shard_t & shard, uint64_t hash, const block_key_t & key);
+    shard_t & shard_of(const uint64_t hash) { return shards_[hash >> (64 - shard_bits)]; }
+
+public:
+    block_index_t();
+
+    [[nodiscard]] bool find(const block_key_t & key, block_location_t & location) const;
+    [[nodiscard]] bool contains(const block_key_t & key) const;
+
+    /// returns false and leaves the entry untouched if key already exists, a new entry has one reference
+    bool insert(const block_key_t & key, const block_location_t & location);
+
+    /// add a reference to a stored block, returns false if key is not stored
+    bool reference(const block_key_t & key);
+    /// drop a reference, returns false if key is not stored or has none left
+    bool release(const block_key_t & key);
+    /// set the count read back from the journal, without journaling it again
+    void restore(const block_key_t & key, uint32_t references);
+    [[nodiscard]] uint32_t references(const block_key_t & key) const;
+
+    /// point key at a copy of its record, unless it was moved away from `from` in the meantime
+    bool relocate(const block_key_t & key, const block_location_t & from, const block_location_t & to);
+    /// remove key if it is still unreferenced and still at location
+    bool erase_unreferenced(const block_key_t & key, const block_location_t & location);
+
+    /// visit(key, location, references) for every entry, one shard locked at a time
+    template < typename Visitor >
+    void for_each(Visitor && visit) const
+    {
+        for (const auto & shard : shards_)
+        {
+            std::shared_lock lock(shard.mutex);
+            for (const auto & slot : shard.slots) {
+                if (slot.location.length != 0) visit(slot.key, slot.location, slot.references);
+            }
+        }
+    }
+
+    /// preallocate room for blocks entries in total
+    void reserve(size_t blocks);
+    [[nodiscard]] size_t size() const;
+    void clear();
+};
+
+#endif //BLOCK_INDEX_H
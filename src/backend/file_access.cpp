@@ -1,86 +1,261 @@
-#include <filesystem>
-#include <fstream>
+#include <atomic>
+#include <cstring>
 #include "file_access.h"
-#include "core/crc64sum.h"
-#include "core/g_global_config_t.h"
+#include "segment_store.h"
+#include "core/cache.h"
+#include "helper/cpp_assert.h"
 #include "helper/log.h"
 #include "helper/lz4frame.h"
+#include "helper/single_flight.h"
+
+static std::atomic < block_hash_t > block_hash = BLOCK_HASH_XXH3_128;
+
+void set_block_hash(const block_hash_t algorithm)
+{
+    block_hash = algorithm;
+}
+
+/* LZ4F contexts and the compressed scratch buffer are reused by every block operation on the same
+ * thread, so the steady state read and write paths do not touch the allocator */
+class lz4_workspace_t
+{
+public:
+    LZ4F_cctx * cctx = nullptr;
+    LZ4F_dctx * dctx = nullptr;
+    std::vector < char > compressed;
+
+    lz4_workspace_t()
+    {
+        assert_short(!LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)));
+        assert_short(!LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)));
+        compressed.resize(LZ4F_compressFrameBound(BLOCK_SIZE, nullptr));
+    }
+
+    lz4_workspace_t(const lz4_workspace_t &) = delete;
+    lz4_workspace_t & operator=(const lz4_workspace_t &) = delete;
+
+    ~lz4_workspace_t()
+    {
+        LZ4F_freeCompressionContext(cctx);
+        LZ4F_freeDecompressionContext(dctx);
+    }
+};
+
+static thread_local lz4_workspace_t lz4_workspace;
+
+// an unreferenced block only waits for the collector, a client has to store it again to keep it
+bool if_exists(const block_key_t & key)
+{
+    return g_segment_store.references(key) != 0;
+}
 
 bool if_exists(const std::string & hashed_block_name)
 {
-    const auto my_own_directory = g_global_config.get<std::string>("server.dictionary");
-    const std::string path = my_own_directory + "/" += hashed_block_name;
-    return std::filesystem::exists(path);
+    block_key_t key;
+    return block_name_to_key(hashed_block_name, key) && if_exists(key);
 }
 
-directory_t::block_t get_block_on_my_end(const std::string & hashed_block_name)
+// decode one stored LZ4 frame straight into a pooled block, content defined chunks come out shorter than BLOCK_SIZE
+static directory_t::block_t decompress_block(const char * in, const uint32_t length)
 {
-    // 1. check if I have this block
-    const auto my_own_directory = g_global_config.get<std::string>("server.dictionary");
-    if (const std::string destination = my_own_directory + "/" += hashed_block_name;
-        std::filesystem::exists(destination))
+    LZ4F_dctx * dctx = lz4_workspace.dctx;
+    directory_t::block_t out = block_buffer_t::allocate();
+
+    // a previous frame that failed to decode leaves the context in an undefined state
+    LZ4F_resetDecompressionContext(dctx);
+
+    size_t inPos = 0, wr_off = 0, ret;
+    for (;;)
     {
-        std::array <char, BLOCK_SIZE> in{};
-        std::array <char, BLOCK_SIZE> out{};
+        size_t srcSize = length - inPos;
+        size_t dstSize = BLOCK_SIZE - wr_off;
+        ret = LZ4F_decompress(dctx, out.data() + wr_off, &dstSize,
+                              in + inPos, &srcSize, nullptr);
+        assert_short(!LZ4F_isError(ret));
 
-        std::ifstream ifs(destination, std::ios::binary);
-        assert_short(ifs.good());
+        wr_off += dstSize;
+        inPos += srcSize;                            /* consume input */
 
-        LZ4F_decompressionContext_t dctx;
-        assert_short(!LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)));
+        if (ret == 0 || inPos == length || wr_off == BLOCK_SIZE) break;      /* frame ended */
+    }
+
+    // running out of input before the end mark is a truncated frame
+    assert_short(wr_off != 0 && (ret == 0 || wr_off == BLOCK_SIZE));
+    out.resize(static_cast<uint32_t>(wr_off));
+    return out;
+}
+
+namespace {
+    struct block_key_hash_t
+    {
+        size_t operator()(const block_key_t & key) const { return key.lo ^ (key.hi * 0x9E3779B97F4A7C15ULL); }
+    };
+
+    // a block missed by many requests at once is read and decompressed by the first of them only
+    single_flight_t < block_key_t, directory_t::block_t, block_key_hash_t > block_flights;
+}
+
+static directory_t::block_t read_block(const segment_store_t::location_t & location)
+{
+    auto & in = lz4_workspace.compressed;
+    if (in.size() < location.length) {
+        in.resize(location.length);    // oversized legacy frame, grows once
+    }
 
-        size_t inPos = 0, inSize = 0, wr_off = 0;
-        for (;;)
+    g_segment_store.read(location, in.data());
+    return decompress_block(in.data(), location.length);
+}
+
+directory_t::block_t get_block_on_my_end(const block_key_t & key)
+{
+    if (directory_t::block_t block; g_block_cache.lookup(key, block)) {
+        return block;
+    }
+
+    // waiters get the leader's buffer, or its no_such_block
+    return block_flights.run(key, [&]
+    {
+        // 1. check if I have this block
+        const auto pin = g_segment_store.pin();
+        segment_store_t::location_t location{};
+        if (!g_segment_store.find(key, location)) {
+            throw no_such_block();
+        }
+
+        auto block = read_block(location);
+        g_block_cache.insert(key, block);  // before the flight lands, so later misses find it here
+        return block;
+    });
+}
+
+std::vector < directory_t::block_t > get_blocks_on_my_end(const std::vector < block_key_t > & keys)
+{
+    using flight_ptr = decltype(block_flights)::flight_ptr;
+    std::vector < directory_t::block_t > blocks(keys.size());
+    std::vector < std::pair < size_t, flight_ptr > > leading, following;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (g_block_cache.lookup(keys[i], blocks[i])) {
+            continue;
+        }
+
+        bool leader;
+        auto flight = block_flights.join(keys[i], leader);
+        (leader ? leading : following).emplace_back(i, std::move(flight));
+    }
+
+    // blocks this call leads are read in full before waiting on anybody else,
+    // so two batches following each other's flights can not deadlock
+    try
+    {
+        const auto pin = g_segment_store.pin();
+        std::vector < size_t > found;
+        std::vector < segment_store_t::location_t > locations;
+        size_t total = 0;
+        for (const auto & [i, flight] : leading)
         {
-            if (inPos == inSize) {                       /* need more input */
-                ifs.read(in.data(), BLOCK_SIZE);
-                inSize = ifs.gcount();
-                inPos  = 0;
-                if (inSize == 0) break;                  /* EOF */
+            if (segment_store_t::location_t location{}; g_segment_store.find(keys[i], location))
+            {
+                found.push_back(i);
+                locations.push_back(location);
+                total += location.length;
             }
+        }
+
+        // every compressed frame gets its slice of one scratch buffer, all reads go out in one submission
+        static thread_local std::vector < char > batch_scratch;
+        if (batch_scratch.size() < total) {
+            batch_scratch.resize(total);
+        }
+
+        std::vector < char * > buffers(locations.size());
+        for (size_t i = 0, offset = 0; i < locations.size(); offset += locations[i].length, i++) {
+            buffers[i] = batch_scratch.data() + offset;
+        }
 
-            size_t srcSize = inSize - inPos;
-            size_t dstSize = BLOCK_SIZE;
-            const size_t ret = LZ4F_decompress(dctx, out.data(), &dstSize,
-                                         in.data() + inPos, &srcSize, nullptr);
-            assert_short(!LZ4F_isError(ret));
+        g_segment_store.read(locations.data(), buffers.data(), locations.size());
+        for (size_t i = 0; i < found.size(); i++) {
+            blocks[found[i]] = decompress_block(buffers[i], locations[i].length);
+            g_block_cache.insert(keys[found[i]], blocks[found[i]]);
+        }
+    }
+    catch (...)
+    {
+        for (const auto & [i, flight] : leading) {
+            block_flights.fail(keys[i], flight, std::current_exception());
+        }
 
-            std::memcpy(in.data() + wr_off, out.data(), dstSize);
-            wr_off += dstSize;
-            inPos += srcSize;                            /* consume input */
+        throw;
+    }
 
-            if (ret == 0 && inPos == inSize) break;      /* frame ended */
+    // followers of a block not stored here get no_such_block, the same as behind a single read,
+    // only this batch keeps the empty slot
+    for (const auto & [i, flight] : leading)
+    {
+        if (blocks[i]) {
+            block_flights.finish(keys[i], flight, blocks[i]);
+        } else {
+            block_flights.fail(keys[i], flight, std::make_exception_ptr(no_such_block()));
         }
+    }
 
-        LZ4F_freeDecompressionContext(dctx);
-        assert_short(wr_off == BLOCK_SIZE);
-        return out;
+    for (const auto & [i, flight] : following)
+    {
+        try {
+            blocks[i] = flight->wait();
+        } catch (const no_such_block &) {
+            // led by a single block read, a batch leaves missing blocks empty
+        }
     }
 
-    throw no_such_block();
+    return blocks;
+}
+
+directory_t::block_t get_block_on_my_end(const std::string & hashed_block_name)
+{
+    block_key_t key;
+    if (!block_name_to_key(hashed_block_name, key)) {
+        throw no_such_block();
+    }
+
+    return get_block_on_my_end(key);
+}
+
+block_key_t store_block_on_my_end(const directory_t::block_t & block)
+{
+    return store_block_on_my_end(block, block_hash);
+}
+
+block_key_t store_block_on_my_end(const directory_t::block_t & block, const block_hash_t algorithm)
+{
+    const block_key_t key = block_key_of(block.data(), block.size(), algorithm);
+
+    // most blocks of a backup are already stored, they cost the hash and one index probe
+    if (g_segment_store.reference(key)) {
+        return key;
+    }
+
+    auto & [cctx, dctx, out] = lz4_workspace;
+    const size_t size = LZ4F_compressFrame_usingCDict(cctx, out.data(), out.size(),
+        block.data(), block.size(), nullptr, nullptr);
+    assert_short(!LZ4F_isError(size));
+
+    g_segment_store.append(key, algorithm, out.data(), static_cast<uint32_t>(size));
+    return key;
 }
 
 std::string write_block_on_my_end(const directory_t::block_t & block)
 {
-    CRC64 checksum;
-    checksum.update(reinterpret_cast<const uint8_t *>(block.data()), block.size());
-    std::string         name = checksum.get_checksum_str();
-    const size_t        max = LZ4F_compressBound(BLOCK_SIZE, nullptr);   /* worst-case */
-    std::vector<char>   out; out.resize(max);
-    const auto          my_own_directories = g_global_config.get<std::string>("server.dictionary");
-    std::ofstream       ofs(my_own_directories + "/" + name, std::ios::binary);
-    assert_short(ofs.good());
-
-    LZ4F_compressionContext_t cctx;
-    assert_short(!LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)));
-    size_t n = LZ4F_compressBegin(cctx, out.data(), max, nullptr);
-    ofs.write(out.data(), static_cast<int>(n));
-    const size_t outSize = LZ4F_compressUpdate(cctx, out.data(), max, block.data(), block.size(), nullptr);
-    assert_short(!LZ4F_isError(outSize));
-    ofs.write(out.data(), static_cast<int>(outSize));
-    n = LZ4F_compressEnd(cctx, out.data(), max, nullptr);             /* adds footer */
-    ofs.write(out.data(), static_cast<int>(n));
-    LZ4F_freeCompressionContext(cctx);
-
-    return name;
+    return block_key_to_name(store_block_on_my_end(block));
+}
+
+bool release_block_on_my_end(const block_key_t & key)
+{
+    return g_segment_store.release(key);
+}
+
+bool release_block_on_my_end(const std::string & hashed_block_name)
+{
+    block_key_t key;
+    return block_name_to_key(hashed_block_name, key) && release_block_on_my_end(key);
 }
@@ -1,12 +1,28 @@
 #ifndef FILE_ACCESS_H
 #define FILE_ACCESS_H
 
-#include <array>
 #include <stdexcept>
 #include "core/directory.h"
+#include "core/block_key.h"
 
 class no_such_block final : public std::runtime_error { public: no_such_block() : std::runtime_error("No such block") { } };
+
+/// algorithm that names newly written blocks, existing blocks stay readable whatever it is
+void set_block_hash(block_hash_t algorithm);
+
+/* Blocks returned by the get functions can be shared with the block cache, treat them as read only */
+bool if_exists(const block_key_t & key);
+bool if_exists(const std::string & hashed_block_name);
+directory_t::block_t get_block_on_my_end(const block_key_t & key);
 directory_t::block_t get_block_on_my_end(const std::string & hash);
-std::string write_block_on_my_end(const directory_t::block_t & block);
+std::vector < directory_t::block_t > get_blocks_on_my_end(const std::vector < block_key_t > & keys);  // empty handle for missing blocks
+block_key_t store_block_on_my_end(const directory_t::block_t & block);      // returns block key
+block_key_t store_block_on_my_end(const directory_t::block_t & block, block_hash_t algorithm);
+std::string write_block_on_my_end(const directory_t::block_t & block);     // returns block name
+
+/* Every store of a block is a reference to it, a client that no longer needs a block releases it.
+ * Blocks without references are reclaimed by the block collector. Returns false if there was nothing to release */
+bool release_block_on_my_end(const block_key_t & key);
+bool release_block_on_my_end(const std::string & hashed_block_name);
 
 #endif //FILE_ACCESS_H
@@ -10,6 +10,10 @@
 #include "instance.h"
 #include "CrowLog.h"
 #include "CrowRegister.h"
+#include "segment_store.h"
+#include "file_access.h"
+#include "core/cache.h"
+#include "block_collector.h"
 #include "SQLiteCpp/SQLiteCpp.h"
 
 const arg_parser::parameter_vector Arguments = {
@@ -54,6 +58,41 @@ void int_signal_handler(int) {
     running = false;
 }
 
+// apply what a config reload can change live, report the rest
+void apply_reloaded_config(const config_snapshot_t & before, const config_snapshot_t & after)
+{
+    // only keys that changed, so environment overrides stay in effect otherwise
+    if (after.debug.verbose != before.debug.verbose) debug::set_verbose(after.debug.verbose);
+    if (after.general.color != before.general.color) color::g_no_color = !after.general.color;
+    if (after.debug.backtrace_level != before.debug.backtrace_level) debug::g_pre_defined_level = after.debug.backtrace_level;
+    if (after.debug.trim_symbol != before.debug.trim_symbol) debug::g_trim_symbol = after.debug.trim_symbol;
+    if (after.server.block_hash != before.server.block_hash) set_block_hash(after.server.block_hash);
+    if (after.server.cache_size != before.server.cache_size)
+    {
+        g_block_cache.resize(after.server.cache_size);
+        verbose_log("Block cache resized to ", after.server.cache_size / 1024 / 1024, "MB");
+    }
+
+    if (after.server.gc_interval != before.server.gc_interval || after.server.gc_bandwidth != before.server.gc_bandwidth) {
+        g_block_collector.configure(after.server.gc_interval, after.server.gc_bandwidth);
+    }
+
+    const std::pair < const char *, bool > startup_only[] = {
+        { "listen_addr", after.server.listen_addr != before.server.listen_addr },
+        { "port", after.server.port != before.server.port },
+        { "dictionary", after.server.dictionary != before.server.dictionary },
+        { "segment_size", after.server.segment_size != before.server.segment_size },
+        { "network_threads", after.server.network_threads != before.server.network_threads },
+        { "io_uring", after.server.io_uring != before.server.io_uring },
+    };
+
+    for (const auto & [key, changed] : startup_only) {
+        if (changed) {
+            warning_log("server.", key, " changed, restart the backend to apply it");
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     try
@@ -116,7 +155,7 @@ int main(int argc, char **argv)
         {
             // output if and only if verbose mode is not enabled before, prevent duplicated output
             verbose_log("Verbose mode enabled\n");
-            debug::verbose = true;
+            debug::set_verbose(true);
         }
 
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -126,39 +165,60 @@ int main(int argc, char **argv)
         if (contains("config", arg_val))
         {
             g_global_config.initialize(arg_val);
-            debug::verbose = true_false_helper(g_global_config.get<std::string>("debug.verbose"));
-            color::g_no_color = !true_false_helper(g_global_config.get<std::string>("general.color"));
-            debug::g_pre_defined_level = g_global_config.get<int>("debug.backtrace_level");
-            debug::g_trim_symbol = true_false_helper(g_global_config.get<std::string>("debug.trim_symbol"));
+            const auto config = g_global_config.snapshot();
+            debug::set_verbose(config->debug.verbose);
+            color::g_no_color = !config->general.color;
+            debug::g_pre_defined_level = config->debug.backtrace_level;
+            debug::g_trim_symbol = config->debug.trim_symbol;
         }
 
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
         if (!get_env("VERBOSE").empty())
         {
-            const bool before = debug::verbose;
-            debug::verbose = true_false_helper(get_env("VERBOSE"));
-            if (before && !debug::verbose) debug_log("Verbose mode disabled by environment variable");
+            const bool before = debug::verbose();
+            debug::set_verbose(true_false_helper(get_env("VERBOSE")));
+            if (before && !debug::verbose()) debug_log("Verbose mode disabled by environment variable");
         }
 
         ////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         // server start
-        int port = g_global_config.get<int>("server.port");
-        auto host = g_global_config.get<std::string>("server.listen_addr");
-        if (port == -1) port = 8080;
-        if (host.empty()) host = "127.0.0.1";
+        const auto config = g_global_config.snapshot();
+        const int port = config->server.port;
+        const std::string host = config->server.listen_addr;
         if (DEBUG) crow::logger::setLogLevel(crow::LogLevel::Debug);
         else crow::logger::setLogLevel(crow::LogLevel::Warning);
         crow::logger::setHandler(&CrowLogHandler);
 
+        // open block storage
+        g_segment_store.open(config->server.dictionary, config->server.segment_size, config->server.io_uring);
+
+        // identity of newly stored blocks, blocks stored under the other algorithm stay readable
+        set_block_hash(config->server.block_hash);
+
+        // hot blocks are served decompressed from memory
+        g_block_cache.resize(config->server.cache_size);
+        verbose_log("Block cache holds up to ", config->server.cache_size / 1024 / 1024, "MB");
+
+        // unreferenced blocks are reclaimed in the background
+        g_block_collector.configure(config->server.gc_interval, config->server.gc_bandwidth);
+        g_block_collector.start();
+
         // setting up handler
         CrowPing();
         CrowIntAlertSSE();
 
-        auto server_thread = std::thread ([&port, &host]() {
+        // pick up config file edits without dropping connections
+        g_global_config.on_reload(apply_reloaded_config);
+        g_global_config.watch();
+
+        // network threads only parse and send frames, block I/O runs on the stream I/O pool
+        const unsigned network_threads = config->server.network_threads;
+
+        auto server_thread = std::thread ([&port, &host, network_threads]() {
             pthread_setname_np(pthread_self(), "Crow");
-            debug_log("Creating service instance on ", host, ":", port);
-            backend_instance.bindaddr(host).port(port).multithreaded().run();
+            debug_log("Creating service instance on ", host, ":", port, " with ", network_threads, " network threads");
+            backend_instance.bindaddr(host).port(port).concurrency(static_cast<uint16_t>(network_threads)).run();
         });
 
         console_log("[main] Waiting 500ms for server to start before register SIGINT/SIGSTP as graceful exit");
@@ -180,6 +240,11 @@ int main(int argc, char **argv)
             server_thread.join();
         }
 
+        g_global_config.stop_watching();
+        CrowStreamStop();
+
+        g_block_collector.stop();
+        g_segment_store.close();
         console_log("[main] Clean up finished");
     }
     catch (const std::exception & e)
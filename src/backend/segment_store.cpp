@@ -0,0 +1,657 @@
+/* segment_store.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "segment_store.h"
+#include "helper/cpp_assert.h"
+#include "helper/log.h"
+
+segment_store_t g_segment_store;
+
+std::string segment_store_t::segment_path(const uint32_t id) const
+{
+    std::stringstream ss;
+    ss << directory_ << "/" << std::setw(8) << std::setfill('0') << id << ".segment";
+    return ss.str();
+}
+
+std::string segment_store_t::hint_path(const uint32_t id) const
+{
+    std::stringstream ss;
+    ss << directory_ << "/" << std::setw(8) << std::setfill('0') << id << ".hint";
+    return ss.str();
+}
+
+void segment_store_t::open_segment(const uint32_t id)
+{
+    const std::string path = segment_path(id);
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    assert_throw(fd != -1, "Cannot open segment " + path + ": " + strerror(errno));
+    segments_.push_back(fd);
+}
+
+uint64_t segment_store_t::segment_size(const uint32_t id) const
+{
+    struct stat st{};
+    assert_throw(fstat(segments_[id], &st) != -1, "Cannot stat segment " + segment_path(id) + ": " + strerror(errno));
+    return static_cast<uint64_t>(st.st_size);
+}
+
+std::vector < segment_store_t::hint_entry_t >
+segment_store_t::load_hint(const uint32_t id, const uint64_t size, bool & valid) const
+{
+    valid = false;
+    std::ifstream ifs(hint_path(id), std::ios::binary);
+    hint_header_t header{};
+    if (!ifs.read(reinterpret_cast<char *>(&header), sizeof(header))
+        || (header.magic != HINT_MAGIC && header.magic != HINT_MAGIC_V0)
+        || header.segment_size != size)   // the segment was written to after the hint, hint is stale
+    {
+        return {};
+    }
+
+    std::vector < hint_entry_t > entries(header.count);
+    if (header.magic == HINT_MAGIC_V0)
+    {
+        std::vector < hint_entry_v0_t > legacy(header.count);
+        if (!ifs.read(reinterpret_cast<char *>(legacy.data()), static_cast<std::streamsize>(legacy.size() * sizeof(hint_entry_v0_t)))) {
+            return {};
+        }
+
+        for (size_t i = 0; i < legacy.size(); i++) {
+            entries[i] = { .key = { .lo = legacy[i].key, .hi = 0 }, .offset = legacy[i].offset,
+                .length = legacy[i].length, .algorithm = BLOCK_HASH_CRC64, .reserved = { } };
+        }
+    }
+    else if (!ifs.read(reinterpret_cast<char *>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(hint_entry_t)))) {
+        return {};
+    }
+
+    valid = true;
+    return entries;
+}
+
+void segment_store_t::write_hint(const uint32_t id, const std::vector < hint_entry_t > & entries, const uint64_t size) const
+{
+    // write to a temporary file first, a half written hint must never look valid
+    const std::string path = hint_path(id);
+    const hint_header_t header { .magic = HINT_MAGIC, .count = static_cast<uint32_t>(entries.size()), .segment_size = size };
+    {
+        std::ofstream ofs(path + ".tmp", std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        ofs.write(reinterpret_cast<const char *>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(hint_entry_t)));
+        if (!ofs.good()) {
+            warning_log("Cannot write hint file ", path);
+            return;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(path + ".tmp", path, ec);
+    if (ec) {
+        warning_log("Cannot write hint file ", path, ": ", ec.message());
+    }
+}
+
+std::vector < segment_store_t::hint_entry_t >
+segment_store_t::scan_segment(const uint32_t id, const bool is_last, uint64_t & end)
+{
+    const int fd = segments_[id];
+    const uint64_t size = segment_size(id);
+    std::vector < hint_entry_t > entries;
+
+    uint64_t offset = 0;
+    while (offset + sizeof(segment_record_v0_t) <= size)
+    {
+        // both record versions start with magic and length, read as much as the larger one needs
+        segment_record_t record{};
+        const ssize_t ret = pread(fd, &record, sizeof(record), static_cast<off_t>(offset));
+        uint64_t header_size;
+        hint_entry_t entry{};
+        if (ret >= static_cast<ssize_t>(sizeof(segment_record_t)) && record.magic == SEGMENT_MAGIC)
+        {
+            header_size = sizeof(segment_record_t);
+            entry.key = record.key;
+            entry.algorithm = record.algorithm;
+        }
+        else if (ret >= static_cast<ssize_t>(sizeof(segment_record_v0_t)) && record.magic == SEGMENT_MAGIC_V0)
+        {
+            segment_record_v0_t legacy{};
+            std::memcpy(&legacy, &record, sizeof(legacy));
+            header_size = sizeof(segment_record_v0_t);
+            entry.key = { .lo = legacy.key, .hi = 0 };
+            entry.algorithm = BLOCK_HASH_CRC64;
+        }
+        else {
+            break;
+        }
+
+        if (record.length == 0 || offset + header_size + record.length > size) {
+            break;
+        }
+
+        entry.offset = offset + header_size;
+        entry.length = record.length;
+        entries.push_back(entry);
+        offset += header_size + record.length;
+    }
+
+    end = size;
+    if (offset != size)
+    {
+        // a torn record at the end of the active segment is what an interrupted append looks like
+        if (is_last) {
+            warning_log("Segment ", segment_path(id), " has a torn tail at ", offset, ", truncating");
+            assert_throw(ftruncate(fd, static_cast<off_t>(offset)) != -1,
+                "Cannot truncate segment " + segment_path(id) + ": " + strerror(errno));
+            end = offset;
+        } else {
+            warning_log("Segment ", segment_path(id), " is corrupted after offset ", offset, ", ignoring the rest");
+        }
+    }
+
+    return entries;
+}
+
+void segment_store_t::load_segment(const uint32_t id, const bool is_last)
+{
+    uint64_t size = segment_size(id);
+    bool valid;
+    auto entries = load_hint(id, size, valid);
+    if (!valid)
+    {
+        entries = scan_segment(id, is_last, size);
+        if (!is_last) {
+            write_hint(id, entries, size);
+        }
+    }
+
+    for (const auto & entry : entries) {
+        index_.insert(entry.key, { .segment = id, .length = entry.length, .offset = entry.offset });
+    }
+
+    if (is_last)
+    {
+        tail_ = size;
+        active_ = std::move(entries);
+    }
+}
+
+void segment_store_t::migrate_legacy_blocks()
+{
+    // dictionaries created before segments hold one LZ4 frame per file, named after its CRC64
+    uint64_t migrated = 0;
+    for (const auto & entry : std::filesystem::directory_iterator(directory_))
+    {
+        const std::string name = entry.path().filename().string();
+        if (!entry.is_regular_file() || name.size() != sizeof(uint64_t) * 2) {
+            continue;
+        }
+
+        block_key_t key;
+        if (!block_name_to_key(name, key)) {
+            continue;
+        }
+
+        std::ifstream ifs(entry.path(), std::ios::binary);
+        const std::vector<char> payload((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+        assert_throw(ifs.good() || ifs.eof(), "Cannot read legacy block " + entry.path().string());
+        append(key, BLOCK_HASH_CRC64, payload.data(), static_cast<uint32_t>(payload.size()));
+        assert_throw(fdatasync(segments_.back()) != -1, std::string("Cannot sync segment: ") + strerror(errno));
+        std::filesystem::remove(entry.path());
+        migrated++;
+    }
+
+    if (migrated != 0) {
+        verbose_log("Migrated ", migrated, " legacy blocks into segments");
+    }
+}
+
+std::string segment_store_t::journal_path() const
+{
+    return directory_ + "/references";
+}
+
+void segment_store_t::load_references()
+{
+    // replay the journal, later records of a key overwrite earlier ones
+    std::ifstream ifs(journal_path(), std::ios::binary);
+    reference_record_t record{};
+    uint64_t replayed = 0;
+    while (ifs.read(reinterpret_cast<char *>(&record), sizeof(record)) && record.magic == REFERENCE_MAGIC)
+    {
+        index_.restore(record.key, record.references);
+        replayed++;
+    }
+
+    ifs.close();
+    journal_base_ = journal_records_ = rewrite_references();
+    verbose_log("Replayed ", replayed, " reference records, ", journal_records_, " blocks are not referenced exactly once");
+}
+
+size_t segment_store_t::rewrite_references()
+{
+    // start over with one record per block that does not have exactly one reference
+    std::vector < reference_record_t > records;
+    index_.for_each([&](const block_key_t & key, const block_location_t &, const uint32_t references) {
+        if (references != 1) records.push_back({ .magic = REFERENCE_MAGIC, .references = references, .key = key });
+    });
+
+    const std::string path = journal_path();
+    {
+        std::ofstream ofs(path + ".tmp", std::ios::binary | std::ios::trunc);
+        ofs.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(reference_record_t)));
+        assert_throw(ofs.good(), "Cannot write reference journal " + path);
+    }
+
+    // opened and synced before the rename, a failure leaves the old journal in place and in use
+    const int fd = ::open((path + ".tmp").c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    assert_throw(fd != -1, "Cannot open reference journal " + path + ": " + strerror(errno));
+    if (fdatasync(fd) == -1)
+    {
+        const int error = errno;
+        ::close(fd);
+        assert_throw(false, "Cannot sync reference journal " + path + ": " + strerror(error));
+    }
+
+    std::filesystem::rename(path + ".tmp", path);
+    if (const int dir = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dir != -1)
+    {
+        fsync(dir);     // the rename itself
+        ::close(dir);
+    }
+
+    if (journal_fd_ != -1) {
+        ::close(journal_fd_);
+    }
+
+    journal_fd_ = fd;
+    return records.size();
+}
+
+void segment_store_t::journal(const block_key_t & key)
+{
+    std::unique_lock lock(journal_mutex_);
+    journal_queue_.push_back(key);
+    const uint64_t sequence = ++journal_queued_;
+    if (!journal_busy_)
+    {
+        journal_busy_ = true;
+        flush_journal(lock);
+    }
+
+    // otherwise whoever is writing takes it with the next batch
+    journal_cv_.wait(lock, [&] { return journal_synced_ >= sequence; });
+}
+
+void segment_store_t::flush_journal(std::unique_lock < std::mutex > & lock)
+{
+    std::vector < reference_record_t > records;
+    while (!journal_queue_.empty())
+    {
+        const auto keys = std::move(journal_queue_);
+        const uint64_t sequence = journal_queued_;
+        journal_queue_.clear();
+        lock.unlock();
+
+        // counts are read after every change in the batch was made, so the last record of a key is never stale.
+        // One O_APPEND write and one fdatasync per batch, everybody queued meanwhile shares the next one
+        records.clear();
+        for (const auto & key : keys) {
+            records.push_back({ .magic = REFERENCE_MAGIC, .references = index_.references(key), .key = key });
+        }
+
+        const auto bytes = static_cast<ssize_t>(records.size() * sizeof(reference_record_t));
+        if (journal_fd_ != -1 && (write(journal_fd_, records.data(), bytes) != bytes || fdatasync(journal_fd_) == -1)) {
+            warning_log("Cannot journal reference count: ", strerror(errno));
+        }
+
+        lock.lock();
+        journal_records_ += records.size();
+        journal_synced_ = sequence;
+        journal_cv_.notify_all();
+    }
+
+    journal_busy_ = false;
+    journal_cv_.notify_all();
+}
+
+void segment_store_t::compact_references()
+{
+    constexpr uint64_t slack = 64 * 1024;   // records, a journal this short is not worth rewriting
+    std::unique_lock lock(journal_mutex_);
+    journal_cv_.wait(lock, [this] { return !journal_busy_; });
+    if (journal_fd_ == -1 || journal_records_ < journal_base_ * 2 + slack) {
+        return;
+    }
+
+    // changes made meanwhile queue up and go into the new journal once it is in place
+    journal_busy_ = true;
+    lock.unlock();
+    try
+    {
+        const size_t records = rewrite_references();
+        lock.lock();
+        verbose_log("Rewrote reference journal of ", journal_records_, " records with ", records);
+        journal_base_ = journal_records_ = records;
+    }
+    catch (...)
+    {
+        if (!lock.owns_lock()) lock.lock();
+        flush_journal(lock);
+        throw;
+    }
+
+    flush_journal(lock);
+}
+
+void segment_store_t::open(const std::string & directory, const uint64_t segment_limit, const bool use_io_uring)
+{
+    close();
+    if (use_io_uring) {
+        ring_.open();
+    }
+
+    directory_ = directory;
+    segment_limit_ = segment_limit;
+    std::filesystem::create_directories(directory_);
+
+    uint32_t count = 0;
+    while (std::filesystem::exists(segment_path(count))) {
+        count++;
+    }
+
+    for (uint32_t id = 0; id < std::max(count, 1u); id++) {
+        open_segment(id);
+    }
+
+    // size the index from the hint headers up front, so the load does not keep rehashing it
+    size_t hinted = 0;
+    for (uint32_t id = 0; id < count; id++)
+    {
+        hint_header_t header{};
+        std::ifstream ifs(hint_path(id), std::ios::binary);
+        if (ifs.read(reinterpret_cast<char *>(&header), sizeof(header)) && (header.magic == HINT_MAGIC || header.magic == HINT_MAGIC_V0)) {
+            hinted += header.count;
+        }
+    }
+
+    index_.reserve(hinted);
+
+    // segments are independent, load them on all cores
+    std::atomic < uint32_t > next = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector < std::thread > loaders;
+    const unsigned threads = std::clamp(std::thread::hardware_concurrency(), 1u, std::max(count, 1u));
+    for (unsigned i = 0; i < threads; i++)
+    {
+        loaders.emplace_back([&]
+        {
+            for (uint32_t id; (id = next++) < count;)
+            {
+                try {
+                    load_segment(id, id + 1 == count);
+                } catch (...) {
+                    std::lock_guard lock(error_mutex);
+                    if (!error) error = std::current_exception();
+                }
+            }
+        });
+    }
+
+    for (auto & loader : loaders) {
+        loader.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    verbose_log("Opened ", segments_.size(), " segments with ", index_.size(), " blocks under ", directory_);
+    migrate_legacy_blocks();
+    load_references();
+}
+
+void segment_store_t::close()
+{
+    std::lock_guard append_lock(append_mutex_);
+    std::unique_lock lock(segments_mutex_);
+    if (!segments_.empty() && !active_.empty()) {
+        write_hint(static_cast<uint32_t>(segments_.size() - 1), active_, tail_);
+    }
+
+    for (const int fd : segments_) {
+        ::close(fd);
+    }
+
+    {
+        std::unique_lock journal_lock(journal_mutex_);
+        journal_cv_.wait(journal_lock, [this] { return !journal_busy_; });
+    }
+
+    if (journal_fd_ != -1) {
+        ::close(journal_fd_);
+        journal_fd_ = -1;
+    }
+
+    ring_.close();
+    segments_.clear();
+    index_.clear();
+    active_.clear();
+    tail_ = 0;
+}
+
+void segment_store_t::read(const location_t & location, char * buffer)
+{
+    char * const buffers[] = { buffer };
+    read(&location, buffers, 1);
+}
+
+void segment_store_t::read(const location_t * locations, char * const * buffers, const size_t count)
+{
+    std::vector < io_ring_t::request_t > requests(count);
+    {
+        std::shared_lock lock(segments_mutex_);
+        for (size_t i = 0; i < count; i++)
+        {
+            requests[i] = {
+                .opcode = io_ring_t::IO_READ,
+                .fd = segments_.at(locations[i].segment),
+                .offset = locations[i].offset,
+                .buffer = buffers[i],
+                .length = locations[i].length,
+            };
+        }
+    }
+
+    ring_.submit(requests.data(), count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const int64_t ret = requests[i].result;
+        assert_throw(ret == static_cast<int64_t>(locations[i].length),
+            "Short read on segment " + segment_path(locations[i].segment) + ": " + (ret < 0 ? strerror(static_cast<int>(-ret)) : "EOF"));
+    }
+}
+
+segment_store_t::location_t segment_store_t::write_record(const block_key_t & key, const block_hash_t algorithm,
+    const char * payload, const uint32_t length)
+{
+    const uint64_t record_size = sizeof(segment_record_t) + length;
+    if (tail_ != 0 && tail_ + record_size > segment_limit_)
+    {
+        // seal the active segment
+        write_hint(static_cast<uint32_t>(segments_.size() - 1), active_, tail_);
+        std::unique_lock lock(segments_mutex_);
+        open_segment(static_cast<uint32_t>(segments_.size()));
+        active_.clear();
+        tail_ = 0;
+    }
+
+    const auto id = static_cast<uint32_t>(segments_.size() - 1);
+    segment_record_t record { .magic = SEGMENT_MAGIC, .length = length, .key = key, .algorithm = algorithm, .reserved = { } };
+    iovec iov[2] = {
+        { .iov_base = &record, .iov_len = sizeof(record) },
+        { .iov_base = const_cast<char *>(payload), .iov_len = length },
+    };
+
+    io_ring_t::request_t request { .opcode = io_ring_t::IO_WRITEV, .fd = segments_.back(),
+        .offset = tail_, .iov = iov, .iovcnt = 2 };
+    ring_.submit(&request, 1);
+    const int64_t ret = request.result;
+    assert_throw(ret == static_cast<int64_t>(record_size),
+        "Short write on segment " + segment_path(id) + ": " + (ret < 0 ? strerror(static_cast<int>(-ret)) : "disk full"));
+
+    const location_t location { .segment = id, .length = length, .offset = tail_ + sizeof(record) };
+    active_.push_back({ .key = key, .offset = location.offset, .length = length, .algorithm = algorithm, .reserved = { } });
+    tail_ += record_size;
+    return location;
+}
+
+segment_store_t::location_t segment_store_t::append(const block_key_t & key, const block_hash_t algorithm,
+    const char * payload, const uint32_t length)
+{
+    location_t location{};
+    {
+        std::lock_guard append_lock(append_mutex_);
+        if (find(key, location)) {
+            index_.reference(key);     // lost the race against another writer of the same block
+        } else {
+            location = write_record(key, algorithm, payload, length);
+            index_.insert(key, location);
+        }
+    }
+
+    journal(key);
+    return location;
+}
+
+bool segment_store_t::reference(const block_key_t & key)
+{
+    if (!index_.reference(key)) {
+        return false;
+    }
+
+    journal(key);
+    return true;
+}
+
+bool segment_store_t::release(const block_key_t & key)
+{
+    if (!index_.release(key)) {
+        return false;
+    }
+
+    journal(key);
+    return true;
+}
+
+std::vector < segment_store_t::segment_usage_t > segment_store_t::usage()
+{
+    std::vector < segment_usage_t > usage;
+    {
+        std::shared_lock lock(segments_mutex_);
+        for (uint32_t id = 0; id < segments_.size(); id++) {
+            usage.push_back({ .size = segment_size(id), .live = 0 });
+        }
+    }
+
+    index_.for_each([&](const block_key_t &, const block_location_t & location, const uint32_t references) {
+        if (references != 0 && location.segment < usage.size()) usage[location.segment].live += sizeof(segment_record_t) + location.length;
+    });
+
+    return usage;
+}
+
+std::vector < block_key_t > segment_store_t::compact(const uint32_t id, const std::function < bool(uint64_t) > & pace)
+{
+    std::vector < hint_entry_t > entries;
+    {
+        std::shared_lock lock(segments_mutex_);
+        assert_throw(id + 1 < segments_.size(), "Only sealed segments can be compacted");
+        uint64_t size = segment_size(id);
+        bool valid;
+        entries = load_hint(id, size, valid);
+        if (!valid) {
+            entries = scan_segment(id, false, size);
+        }
+    }
+
+    std::vector < block_key_t > dropped;
+    std::vector < char > payload;
+    std::vector < uint32_t > targets;
+    for (const auto & entry : entries)
+    {
+        const location_t location { .segment = id, .length = entry.length, .offset = entry.offset };
+        if (location_t current{}; !find(entry.key, current) || current.segment != id || current.offset != entry.offset) {
+            continue;   // a stale copy, the index points elsewhere
+        }
+
+        // checks the count under the entry's lock, a block referenced again in the meantime is copied like any other
+        if (index_.erase_unreferenced(entry.key, location))
+        {
+            dropped.push_back(entry.key);
+            continue;
+        }
+
+        if (!pace(sizeof(segment_record_t) + entry.length)) {
+            return dropped;
+        }
+
+        payload.resize(entry.length);
+        read(location, payload.data());
+
+        std::lock_guard append_lock(append_mutex_);
+        const location_t moved = write_record(entry.key, entry.algorithm, payload.data(), entry.length);
+        index_.relocate(entry.key, location, moved);
+        if (targets.empty() || targets.back() != moved.segment) {
+            targets.push_back(moved.segment);
+        }
+    }
+
+    // the copies have to be on disk before the originals go
+    {
+        std::shared_lock lock(segments_mutex_);
+        for (const uint32_t target : targets) {
+            assert_throw(fdatasync(segments_[target]) != -1, "Cannot sync segment " + segment_path(target) + ": " + strerror(errno));
+        }
+    }
+
+    // wait out readers that found a location in this segment before it was moved
+    {
+        std::unique_lock barrier(reclaim_mutex_);
+    }
+
+    std::shared_lock lock(segments_mutex_);
+    assert_throw(ftruncate(segments_[id], 0) != -1, "Cannot truncate segment " + segment_path(id) + ": " + strerror(errno));
+    write_hint(id, { }, 0);
+    return dropped;
+}
@@ -0,0 +1,198 @@
+/* segment_store.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include "block_index.h"
+#include "helper/io_ring.h"
+
+#define SEGMENT_MAGIC_V0 (0x304B4C42) /* "BLK0", 64-bit CRC64 keys */
+#define SEGMENT_MAGIC    (0x314B4C42) /* "BLK1", 128-bit keys and their hash algorithm */
+#define HINT_MAGIC_V0    (0x30544E48) /* "HNT0" */
+#define HINT_MAGIC       (0x31544E48) /* "HNT1" */
+#define REFERENCE_MAGIC  (0x31464552) /* "REF1" */
+
+/* Log-structured block store.
+ * Blocks are appended to large segment files (<dictionary>/<id>.segment), every record is
+ * [segment_record_t][compressed payload]. The index maps the block hash to its record.
+ * Every segment gets a hint file (<id>.hint) listing its records once it is sealed, so that
+ * startup reads the hints instead of walking every record header.
+ * Records and hints of the first (CRC64 only) version are still read, new ones are always current.
+ *
+ * Reference counts live in the index and are journaled to <dictionary>/references after they change,
+ * a block missing from the journal has the one reference of its first store. A changed count is on
+ * disk (fdatasync) before reference(), release() or append() return, concurrent changes share one
+ * sync, so a crash never takes back a count a client was told about. The journal is rewritten at
+ * startup and by compact_references(), the new one is synced before it replaces the old.
+ * Unreferenced blocks stay readable until compact() copies the live records of their segment to
+ * the tail and truncates it. */
+extern
+class segment_store_t {
+public:
+    using location_t = block_location_t;
+
+    struct segment_record_v0_t
+    {
+        uint32_t magic;
+        uint32_t length;    // payload length
+        uint64_t key;       // CRC64 block hash
+    };
+
+    struct segment_record_t
+    {
+        uint32_t magic;
+        uint32_t length;    // payload length
+        block_key_t key;
+        block_hash_t algorithm;
+        uint8_t reserved[7];
+    };
+
+    struct hint_header_t
+    {
+        uint32_t magic;
+        uint32_t count;
+        uint64_t segment_size;  // size of the segment when the hint was written
+    };
+
+    struct hint_entry_v0_t
+    {
+        uint64_t key;
+        uint64_t offset;
+        uint32_t length;
+        uint32_t reserved;
+    };
+
+    struct hint_entry_t
+    {
+        block_key_t key;
+        uint64_t offset;
+        uint32_t length;
+        block_hash_t algorithm;
+        uint8_t reserved[3];
+    };
+
+    struct reference_record_t
+    {
+        uint32_t magic;
+        uint32_t references;    // count from this point on, the last record of a key wins
+        block_key_t key;
+    };
+
+    struct segment_usage_t
+    {
+        uint64_t size;          // bytes in the segment file
+        uint64_t live;          // bytes of records the index points at that are still referenced
+    };
+
+private:
+    std::string directory_;
+    uint64_t segment_limit_ = 0;
+    block_index_t index_;
+
+    std::shared_mutex segments_mutex_;
+    std::vector < int > segments_;              // segment id -> fd
+
+    io_ring_t ring_;                            // block reads and appends, blocking I/O if unavailable
+
+    std::mutex append_mutex_;
+    uint64_t tail_ = 0;                         // write offset of the active (last) segment
+    std::vector < hint_entry_t > active_;       // records of the active segment
+
+    int journal_fd_ = -1;                       // reference journal
+    std::mutex journal_mutex_;                  // guards the queue and the counters below
+    std::condition_variable journal_cv_;        // a batch reached the disk, or the journal went idle
+    std::vector < block_key_t > journal_queue_; // keys whose count changed since the last journal write
+    bool journal_busy_ = false;                 // a thread is writing the queue out or rewriting the journal
+    uint64_t journal_queued_ = 0;               // keys ever queued
+    uint64_t journal_synced_ = 0;               // keys ever queued that are on disk
+    uint64_t journal_records_ = 0;              // records in the journal
+    uint64_t journal_base_ = 0;                 // records it had when it was last rewritten
+    std::shared_mutex reclaim_mutex_;           // held shared from index lookup to read, compact() waits it out
+
+    [[nodiscard]] std::string segment_path(uint32_t id) const;
+    [[nodiscard]] std::string hint_path(uint32_t id) const;
+    void open_segment(uint32_t id);
+    [[nodiscard]] uint64_t segment_size(uint32_t id) const;
+    std::vector < hint_entry_t > load_hint(uint32_t id, uint64_t size, bool & valid) const;
+    void write_hint(uint32_t id, const std::vector < hint_entry_t > & entries, uint64_t size) const;
+    std::vector < hint_entry_t > scan_segment(uint32_t id, bool is_last, uint64_t & end);
+    void load_segment(uint32_t id, bool is_last);
+    void migrate_legacy_blocks();
+    [[nodiscard]] std::string journal_path() const;
+    void load_references();
+    size_t rewrite_references();
+    void journal(const block_key_t & key);
+    void flush_journal(std::unique_lock < std::mutex > & lock);
+    location_t write_record(const block_key_t & key, block_hash_t algorithm, const char * payload, uint32_t length);
+
+public:
+    /// open (or create) the store under directory, roll over to a new segment after segment_limit bytes
+    void open(const std::string & directory, uint64_t segment_limit, bool use_io_uring = true);
+    void close();
+
+    [[nodiscard]] bool contains(const block_key_t & key) const { return index_.contains(key); }
+    [[nodiscard]] bool find(const block_key_t & key, location_t & location) const { return index_.find(key, location); }
+    [[nodiscard]] size_t size() const { return index_.size(); }
+
+    /// count another store of a block that is already here, returns false if it is not
+    bool reference(const block_key_t & key);
+    /// drop one reference, returns false if the block is not here or has none left
+    bool release(const block_key_t & key);
+    [[nodiscard]] uint32_t references(const block_key_t & key) const { return index_.references(key); }
+
+    /// hold while a location found in the index is being read, so compaction can not truncate it underneath
+    [[nodiscard]] std::shared_lock < std::shared_mutex > pin() { return std::shared_lock(reclaim_mutex_); }
+
+    /// read the payload of the record into buffer (at least location.length bytes)
+    void read(const location_t & location, char * buffer);
+
+    /// read many records with a single submission, buffers[i] receives locations[i]
+    void read(const location_t * locations, char * const * buffers, size_t count);
+
+    /// append one record, returns its location. Appending an existing key only adds a reference
+    location_t append(const block_key_t & key, block_hash_t algorithm, const char * payload, uint32_t length);
+
+    /// size and live bytes of every segment, the last one is the active segment
+    [[nodiscard]] std::vector < segment_usage_t > usage();
+
+    /// move the referenced records of sealed segment id to the tail, forget its unreferenced ones and
+    /// truncate it. pace(bytes) is asked before every record is copied, false stops early and leaves
+    /// the segment as it is. Returns the keys of the blocks that are gone
+    std::vector < block_key_t > compact(uint32_t id, const std::function < bool(uint64_t) > & pace);
+
+    /// rewrite the reference journal with one record per block once it has grown well past that
+    void compact_references();
+
+    ~segment_store_t() { close(); }
+} g_segment_store;
+
+static_assert(sizeof(segment_store_t::segment_record_t) == 32 && sizeof(segment_store_t::hint_entry_t) == 32
+    && sizeof(segment_store_t::reference_record_t) == 24,
+    "segment records, hint entries and reference records are written to disk as is");
+
+#endif //SEGMENT_STORE_H
@@ -0,0 +1,188 @@
+/* stream_protocol.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef STREAM_PROTOCOL_H
+#define STREAM_PROTOCOL_H
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "core/block_key.h"
+
+/* Binary /stream protocol.
+ * Negotiated on connect by requesting one of the binary WebSocket subprotocols
+ * (Sec-WebSocket-Protocol). On such a connection every binary frame is one message:
+ *
+ *   [header (little-endian)][length bytes of payload]
+ *
+ * v2 headers are 32 bytes and carry a 16 byte block_key_t, keys in payloads are 16 bytes (lo, hi).
+ * v1 headers are 24 bytes and carry a u64 key, keys in payloads are 8 bytes. A v1 key is a CRC64
+ * block key, so blocks dumped over v1 are stored under CRC64 whatever server.block_hash says.
+ * v3 frames are v2 frames, but dumped blocks are stored as long as they are instead of zero padded
+ * to BLOCK_SIZE. It is meant for clients that cut files into content defined chunks (core/chunker.h).
+ *
+ * Requests:  query_block  key = block key, no payload
+ *            dump_block   payload = raw block content (up to BLOCK_SIZE, zero padded before v3)
+ *            query_blocks payload = key per block
+ *            dump_blocks  payload = [u32 length][content] per block
+ *            have_blocks  payload = key per block
+ *            release_blocks payload = key per block, drops one reference of each
+ *            close        no payload
+ * Responses carry the opcode and request_id of the request they answer. Requests are pipelined,
+ * a client may keep many in flight and responses arrive in completion order, not request order.
+ *            query_block  payload = raw block content
+ *            dump_block   key = key of the stored block
+ *            query_blocks payload = [u32 length][content] per requested key, length 0 if it is missing
+ *            dump_blocks  payload = key per stored block, in request order
+ *            have_blocks  payload = presence bitmap, bit (i % 8) of byte (i / 8) is set if key i exists
+ *            release_blocks payload = bitmap as for have_blocks, set if key i had a reference to release
+ *            on error     status = STREAM_STATUS_ERROR, payload = error message
+ * Batch requests carry at most STREAM_MAX_BATCH blocks.
+ * Text frames keep using the JSON protocol on every connection. */
+
+#define STREAM_BINARY_PROTOCOL_V1 "fss.stream.binary.v1"
+#define STREAM_BINARY_PROTOCOL "fss.stream.binary.v2"
+#define STREAM_BINARY_PROTOCOL_V3 "fss.stream.binary.v3"
+#define STREAM_MAX_BATCH (256)
+
+enum stream_opcode_t : uint8_t
+{
+    STREAM_QUERY_BLOCK  = 0x01,
+    STREAM_DUMP_BLOCK   = 0x02,
+    STREAM_QUERY_BLOCKS = 0x03,
+    STREAM_DUMP_BLOCKS  = 0x04,
+    STREAM_HAVE_BLOCKS  = 0x05,
+    STREAM_RELEASE_BLOCKS = 0x06,
+    STREAM_CLOSE        = 0x0F,
+};
+
+enum stream_status_t : uint8_t
+{
+    STREAM_STATUS_SUCCESS   = 0x00,
+    STREAM_STATUS_ERROR     = 0x01,
+};
+
+struct stream_header_t
+{
+    uint8_t  opcode;
+    uint8_t  status;
+    uint16_t reserved;
+    uint32_t request_id;
+    block_key_t key;
+    uint32_t length;        // payload length
+    uint32_t reserved2;
+};
+
+struct stream_header_v1_t
+{
+    uint8_t  opcode;
+    uint8_t  status;
+    uint16_t reserved;
+    uint32_t request_id;
+    uint64_t hash;
+    uint32_t length;        // payload length
+    uint32_t reserved2;
+};
+
+static_assert(sizeof(stream_header_t) == 32, "stream_header_t must not be padded");
+static_assert(sizeof(stream_header_v1_t) == 24, "stream_header_v1_t must not be padded");
+static_assert(std::endian::native == std::endian::little, "binary stream protocol is little-endian on the wire");
+
+enum stream_version_t : uint8_t { STREAM_V1 = 1, STREAM_V2 = 2, STREAM_V3 = 3 };
+
+/// bytes per key in batch payloads
+constexpr size_t stream_key_size(const stream_version_t version)
+{
+    return version == STREAM_V1 ? sizeof(uint64_t) : sizeof(block_key_t);
+}
+
+/// parse a binary frame, v1 headers are widened to stream_header_t. returns false if it is malformed
+inline bool stream_decode(const std::string_view message, const stream_version_t version,
+    stream_header_t & header, std::string_view & payload)
+{
+    if (version == STREAM_V1)
+    {
+        stream_header_v1_t v1{};
+        if (message.size() < sizeof(v1)) {
+            return false;
+        }
+
+        std::memcpy(&v1, message.data(), sizeof(v1));
+        header = { .opcode = v1.opcode, .status = v1.status, .reserved = 0, .request_id = v1.request_id,
+            .key = { .lo = v1.hash, .hi = 0 }, .length = v1.length, .reserved2 = 0 };
+        payload = message.substr(sizeof(v1));
+        return header.length == payload.size();
+    }
+
+    if (message.size() < sizeof(stream_header_t)) {
+        return false;
+    }
+
+    std::memcpy(&header, message.data(), sizeof(header));
+    payload = message.substr(sizeof(header));
+    return header.length == payload.size();
+}
+
+/// build one binary frame, the payload is copied exactly once into the frame
+inline std::string stream_encode(stream_header_t header, const stream_version_t version,
+    const std::string_view payload = {})
+{
+    header.length = static_cast<uint32_t>(payload.size());
+    std::string frame;
+    if (version == STREAM_V1)
+    {
+        // v1 keys are CRC64 keys, anything wider does not fit and is reported as 0
+        const stream_header_v1_t v1 { .opcode = header.opcode, .status = header.status, .reserved = 0,
+            .request_id = header.request_id, .hash = header.key.hi == 0 ? header.key.lo : 0,
+            .length = header.length, .reserved2 = 0 };
+        frame.reserve(sizeof(v1) + payload.size());
+        frame.append(reinterpret_cast<const char *>(&v1), sizeof(v1));
+    }
+    else
+    {
+        frame.reserve(sizeof(header) + payload.size());
+        frame.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+
+    frame.append(payload);
+    return frame;
+}
+
+/// append one key in the wire format of the given version
+inline void stream_append_key(std::string & out, const block_key_t & key, const stream_version_t version)
+{
+    out.append(reinterpret_cast<const char *>(&key), stream_key_size(version));
+}
+
+/// bit i of the bitmap tells whether present[i] is set
+inline std::string stream_bitmap(const std::vector < bool > & present)
+{
+    std::string bitmap((present.size() + 7) / 8, '\0');
+    for (size_t i = 0; i < present.size(); i++) {
+        if (present[i]) bitmap[i / 8] |= static_cast<char>(1 << (i % 8));
+    }
+
+    return bitmap;
+}
+
+#endif //STREAM_PROTOCOL_H
@@ -0,0 +1,391 @@
+/* base64.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include "core/base64.h"
+#include "helper/base64.hpp"
+
+#if defined(__x86_64__)
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+namespace {
+    void encode_scalar(const uint8_t * in, const size_t length, char * out)
+    {
+        using namespace base64::detail;
+        size_t i = 0;
+        for (; i + 3 <= length; i += 3, out += 4)
+        {
+            out[0] = encode_table_0[in[i]];
+            out[1] = encode_table_1[(in[i] & 0x03) << 4 | in[i + 1] >> 4];
+            out[2] = encode_table_1[(in[i + 1] & 0x0F) << 2 | in[i + 2] >> 6];
+            out[3] = encode_table_1[in[i + 2]];
+        }
+
+        if (length - i == 1)
+        {
+            out[0] = encode_table_0[in[i]];
+            out[1] = encode_table_1[(in[i] & 0x03) << 4];
+            out[2] = out[3] = padding_char;
+        }
+        else if (length - i == 2)
+        {
+            out[0] = encode_table_0[in[i]];
+            out[1] = encode_table_1[(in[i] & 0x03) << 4 | in[i + 1] >> 4];
+            out[2] = encode_table_1[(in[i + 1] & 0x0F) << 2];
+            out[3] = padding_char;
+        }
+    }
+
+    // one group of up to 4 characters into up to 3 bytes, false on a character outside the alphabet
+    bool decode_group(const uint8_t * in, const size_t characters, uint8_t * out)
+    {
+        using namespace base64::detail;
+        uint32_t bits = decode_table_0[in[0]] | decode_table_1[in[1]];
+        if (characters > 2) bits |= decode_table_2[in[2]];
+        if (characters > 3) bits |= decode_table_3[in[3]];
+        if (bits >= bad_char) {
+            return false;
+        }
+
+        uint8_t bytes[4];
+        std::memcpy(bytes, &bits, sizeof(bits));
+        constexpr size_t index[] = { decidx0, decidx1, decidx2 };
+        for (size_t i = 0; i < characters - 1; i++) {
+            out[i] = bytes[index[i]];
+        }
+
+        return true;
+    }
+
+    // decoders handle groups of 4 characters without padding, and return false on a bad character
+    bool decode_scalar(const uint8_t * in, const size_t groups, uint8_t * out)
+    {
+        for (size_t i = 0; i < groups; i++) {
+            if (!decode_group(in + 4 * i, 4, out + 3 * i)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+#if defined(__x86_64__)
+    /* Kernels after Wojciech Muła's pshufb base64 codecs (http://0x80.pl/articles/index.html#base64).
+     * Encoding: a pshufb copies each 3 byte group into a 32-bit lane, two multiplies move the four
+     * 6-bit indexes into their own bytes, and a 16 entry pshufb table turns each index range
+     * (A-Z, a-z, 0-9, +, /) into the offset that makes it ASCII.
+     * Decoding: the two nibbles of each character index bitmask tables whose AND is zero only for
+     * alphabet characters, a third table gives the offset back to the 6-bit value, and
+     * pmaddubsw/pmaddwd with a pshufb pack four 6-bit values into three bytes. */
+
+    __attribute__((target("ssse3")))
+    __m128i encode_lookup_ssse3(const __m128i indexes)
+    {
+        // 0..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12, then 0..25 -> 13
+        __m128i shift = _mm_subs_epu8(indexes, _mm_set1_epi8(51));
+        shift = _mm_or_si128(shift, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indexes), _mm_set1_epi8(13)));
+        const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        return _mm_add_epi8(_mm_shuffle_epi8(offsets, shift), indexes);
+    }
+
+    __attribute__((target("ssse3")))
+    __m128i encode_split_ssse3(const __m128i bytes)
+    {
+        const __m128i in = _mm_shuffle_epi8(bytes, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        return _mm_or_si128(t0, t1);
+    }
+
+    __attribute__((target("ssse3")))
+    void encode_ssse3(const uint8_t * in, const size_t length, char * out)
+    {
+        // 16 byte loads, 12 of them used
+        size_t i = 0;
+        for (; i + 16 <= length; i += 12, out += 16)
+        {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out), encode_lookup_ssse3(encode_split_ssse3(bytes)));
+        }
+
+        encode_scalar(in + i, length - i, out);
+    }
+
+    __attribute__((target("sse4.1")))
+    bool decode_ssse3(const uint8_t * in, const size_t groups, uint8_t * out)
+    {
+        const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i nibble_mask = _mm_set1_epi8(0x0F);
+
+        // 16 byte stores, 12 of them used, so stop while 2 groups of output are still left
+        size_t i = 0;
+        for (; i + 6 <= groups; i += 4)
+        {
+            const __m128i text = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 4 * i));
+            const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(text, 4), nibble_mask);
+            const __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(text, nibble_mask));
+            const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+            if (!_mm_testz_si128(lo, hi)) {
+                return false;
+            }
+
+            const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(text, _mm_set1_epi8('/')), hi_nibbles));
+            const __m128i values = _mm_add_epi8(text, roll);
+            const __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+            const __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+            const __m128i bytes = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 3 * i), bytes);
+        }
+
+        return decode_scalar(in + 4 * i, groups - i, out + 3 * i);
+    }
+
+    __attribute__((target("avx2")))
+    void encode_avx2(const uint8_t * in, const size_t length, char * out)
+    {
+        const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+            'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        const __m256i split = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+            10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+
+        // 12 bytes from each of two 16 byte loads, one per 128-bit lane
+        size_t i = 0;
+        for (; i + 28 <= length; i += 24, out += 32)
+        {
+            const __m256i bytes = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 12)), 1);
+            const __m256i grouped = _mm256_shuffle_epi8(bytes, split);
+            const __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(grouped, _mm256_set1_epi32(0x0FC0FC00)),
+                _mm256_set1_epi32(0x04000040));
+            const __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(grouped, _mm256_set1_epi32(0x003F03F0)),
+                _mm256_set1_epi32(0x01000010));
+            const __m256i indexes = _mm256_or_si256(t0, t1);
+
+            __m256i shift = _mm256_subs_epu8(indexes, _mm256_set1_epi8(51));
+            shift = _mm256_or_si256(shift, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indexes),
+                _mm256_set1_epi8(13)));
+            const __m256i text = _mm256_add_epi8(_mm256_shuffle_epi8(offsets, shift), indexes);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), text);
+        }
+
+        encode_ssse3(in + i, length - i, out);
+    }
+
+    __attribute__((target("avx2")))
+    bool decode_avx2(const uint8_t * in, const size_t groups, uint8_t * out)
+    {
+        const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+        const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const __m256i nibble_mask = _mm256_set1_epi8(0x0F);
+
+        // 32 byte stores, 24 of them used, so stop while 3 groups of output are still left
+        size_t i = 0;
+        for (; i + 11 <= groups; i += 8)
+        {
+            const __m256i text = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 4 * i));
+            const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(text, 4), nibble_mask);
+            const __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(text, nibble_mask));
+            const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+            if (!_mm256_testz_si256(lo, hi)) {
+                return false;
+            }
+
+            const __m256i roll = _mm256_shuffle_epi8(lut_roll,
+                _mm256_add_epi8(_mm256_cmpeq_epi8(text, _mm256_set1_epi8('/')), hi_nibbles));
+            const __m256i values = _mm256_add_epi8(text, roll);
+            const __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+            const __m256i words = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+            // 12 bytes at the start of each lane, close the gap between them
+            const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(words, pack),
+                _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 3 * i), bytes);
+        }
+
+        return decode_ssse3(in + 4 * i, groups - i, out + 3 * i);
+    }
+
+    bool cpu_supports(const base64::kernel_t kernel)
+    {
+        unsigned eax, ebx, ecx, edx;
+        if (kernel == base64::SCALAR) {
+            return true;
+        }
+
+        // the SSSE3 decoder also uses ptest from SSE4.1
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1)) {
+            return false;
+        }
+
+        if (kernel == base64::SSSE3) {
+            return true;
+        }
+
+        // ymm state has to be saved by the OS (XCR0 SSE and AVX bits)
+        if (!(ecx & bit_OSXSAVE)) {
+            return false;
+        }
+
+        unsigned xcr0_lo, xcr0_hi;
+        __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo & 0x06) != 0x06) {
+            return false;
+        }
+
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+    }
+#else
+    bool cpu_supports(const base64::kernel_t kernel) { return kernel == base64::SCALAR; }
+#endif
+
+    using encode_t = void (*)(const uint8_t *, size_t, char *);
+    using decode_t = bool (*)(const uint8_t *, size_t, uint8_t *);
+
+    encode_t encoder(const base64::kernel_t kernel)
+    {
+        switch (kernel)
+        {
+#if defined(__x86_64__)
+            case base64::AVX2: return encode_avx2;
+            case base64::SSSE3: return encode_ssse3;
+#endif
+            default: return encode_scalar;
+        }
+    }
+
+    decode_t decoder(const base64::kernel_t kernel)
+    {
+        switch (kernel)
+        {
+#if defined(__x86_64__)
+            case base64::AVX2: return decode_avx2;
+            case base64::SSSE3: return decode_ssse3;
+#endif
+            default: return decode_scalar;
+        }
+    }
+
+    // picked once, by cpuid
+    const base64::kernel_t best_kernel = [] {
+        for (const auto kernel : { base64::AVX2, base64::SSSE3 }) {
+            if (cpu_supports(kernel)) return kernel;
+        }
+        return base64::SCALAR;
+    }();
+
+    size_t decode(const decode_t kernel, const std::string_view text, void * out, const size_t capacity)
+    {
+        const size_t size = base64::decoded_size(text);
+        if (size > capacity) {
+            throw std::runtime_error{"Invalid base64 encoded data - Decoded data does not fit"};
+        }
+
+        if (size == 0) {
+            return 0;
+        }
+
+        // the last group may be padded, it always goes through the scalar code
+        const auto in = reinterpret_cast<const uint8_t *>(text.data());
+        const auto bytes = static_cast<uint8_t *>(out);
+        const size_t groups = text.size() / 4 - 1;
+        const size_t padding = (groups + 1) * 3 - size;
+        if (!kernel(in, groups, bytes) || !decode_group(in + 4 * groups, 4 - padding, bytes + 3 * groups)) {
+            throw std::runtime_error{"Invalid base64 encoded data - Invalid character"};
+        }
+
+        return size;
+    }
+}
+
+namespace base64 {
+    size_t decoded_size(const std::string_view text)
+    {
+        if (text.size() % 4 != 0) {
+            throw std::runtime_error{"Invalid base64 encoded data - Size not divisible by 4"};
+        }
+
+        if (text.empty()) {
+            return 0;
+        }
+
+        // a '=' anywhere else is rejected by the decoders as a character outside the alphabet
+        const size_t padding = text.back() != detail::padding_char ? 0
+            : 1 + (text[text.size() - 2] == detail::padding_char);
+        return text.size() / 4 * 3 - padding;
+    }
+
+    void encode(const void * data, const size_t length, char * text)
+    {
+        encoder(best_kernel)(static_cast<const uint8_t *>(data), length, text);
+    }
+
+    std::string encode(const std::string_view data)
+    {
+        std::string text(encoded_size(data.size()), '\0');
+        encode(data.data(), data.size(), text.data());
+        return text;
+    }
+
+    size_t decode(const std::string_view text, void * out, const size_t capacity)
+    {
+        return ::decode(decoder(best_kernel), text, out, capacity);
+    }
+
+    kernel_t active_kernel()
+    {
+        return best_kernel;
+    }
+
+    bool kernel_supported(const kernel_t kernel)
+    {
+        return cpu_supports(kernel);
+    }
+
+    void encode_with(const kernel_t kernel, const void * data, const size_t length, char * text)
+    {
+        encoder(kernel)(static_cast<const uint8_t *>(data), length, text);
+    }
+
+    size_t decode_with(const kernel_t kernel, const std::string_view text, void * out, const size_t capacity)
+    {
+        return ::decode(decoder(kernel), text, out, capacity);
+    }
+}
@@ -18,67 +18,296 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <array>
+#include <cstdint>
 #include <stdexcept>
 #include "core/bin2hex.h"
 
-constexpr int max_line_char_num = 64;
+#if defined(__x86_64__)
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+namespace {
+    constexpr char hex_digits[] = "0123456789abcdef";
+
+    // hex digit -> nibble, 0xFF for anything that is not a hex digit
+    consteval std::array < uint8_t, 256 > make_nibble_table()
+    {
+        std::array < uint8_t, 256 > table{};
+        table.fill(0xFF);
+        for (uint8_t i = 0; i < 16; i++) {
+            table[static_cast<uint8_t>(hex_digits[i])] = i;
+            table[static_cast<uint8_t>(hex_digits[i] & ~0x20)] = i;   // uppercase, digits are unaffected
+        }
+
+        return table;
+    }
+
+    constexpr auto nibble_table = make_nibble_table();
+
+    void encode_scalar(const uint8_t * bin, const size_t length, char * hex)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            hex[2 * i] = hex_digits[bin[i] >> 4];
+            hex[2 * i + 1] = hex_digits[bin[i] & 0x0F];
+        }
+    }
+
+    bool decode_scalar(const uint8_t * hex, const size_t length, uint8_t * bin)
+    {
+        // invalid digits have the top bits set, collect them and check once at the end
+        uint8_t invalid = 0;
+        for (size_t i = 0; i < length / 2; i++)
+        {
+            const uint8_t hi = nibble_table[hex[2 * i]];
+            const uint8_t lo = nibble_table[hex[2 * i + 1]];
+            invalid |= hi | lo;
+            bin[i] = static_cast<uint8_t>(hi << 4 | (lo & 0x0F));
+        }
+
+        return (invalid & 0xF0) == 0;
+    }
+
+#if defined(__x86_64__)
+    /* Encoding splits every byte into its two nibbles and turns them into digits with one pshufb
+     * on "0123456789abcdef", interleaving high and low digits back into text order.
+     * Decoding folds case, maps '0'-'9' and 'a'-'f' to nibbles with range compares, and packs
+     * digit pairs with pmaddubsw (hi * 16 + lo). Anything outside both ranges sets the error mask. */
+
+    __attribute__((target("ssse3")))
+    void encode_ssse3(const uint8_t * bin, const size_t length, char * hex)
+    {
+        const __m128i digits = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hex_digits));
+        const __m128i low_mask = _mm_set1_epi8(0x0F);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16)
+        {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bin + i));
+            const __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask));
+            const __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(bytes, low_mask));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(hex + 2 * i), _mm_unpacklo_epi8(hi, lo));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(hex + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+        }
+
+        encode_scalar(bin + i, length - i, hex + 2 * i);
+    }
+
+    // 16 hex digits to their nibbles, error lanes are set to 0xFF
+    __attribute__((target("ssse3")))
+    __m128i nibbles_ssse3(const __m128i text, __m128i & error)
+    {
+        const __m128i lower = _mm_or_si128(text, _mm_set1_epi8(0x20));
+        const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(text, _mm_set1_epi8('0' - 1)),
+            _mm_cmplt_epi8(text, _mm_set1_epi8('9' + 1)));
+        const __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+            _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+        error = _mm_or_si128(error, _mm_andnot_si128(_mm_or_si128(is_digit, is_alpha), _mm_set1_epi8(-1)));
+
+        const __m128i digit = _mm_and_si128(is_digit, _mm_sub_epi8(text, _mm_set1_epi8('0')));
+        const __m128i alpha = _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+        return _mm_or_si128(digit, alpha);
+    }
+
+    __attribute__((target("ssse3")))
+    bool decode_ssse3(const uint8_t * hex, const size_t length, uint8_t * bin)
+    {
+        const __m128i weights = _mm_set1_epi16(0x0110);     // bytes { 16, 1 }: high digit first
+        __m128i error = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            const __m128i a = nibbles_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hex + i)), error);
+            const __m128i b = nibbles_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hex + i + 16)), error);
+            const __m128i bytes = _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(bin + i / 2), bytes);
+        }
+
+        const bool tail = decode_scalar(hex + i, length - i, bin + i / 2);
+        return tail && _mm_movemask_epi8(error) == 0;
+    }
+
+    __attribute__((target("avx2")))
+    void encode_avx2(const uint8_t * bin, const size_t length, char * hex)
+    {
+        const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hex_digits)));
+        const __m256i low_mask = _mm256_set1_epi8(0x0F);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32)
+        {
+            const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bin + i));
+            const __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_mask));
+            const __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(bytes, low_mask));
+            // unpack works within 128-bit lanes: first holds bytes 0-7 and 16-23, second 8-15 and 24-31
+            const __m256i first = _mm256_unpacklo_epi8(hi, lo);
+            const __m256i second = _mm256_unpackhi_epi8(hi, lo);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(hex + 2 * i), _mm256_permute2x128_si256(first, second, 0x20));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(hex + 2 * i + 32), _mm256_permute2x128_si256(first, second, 0x31));
+        }
+
+        encode_ssse3(bin + i, length - i, hex + 2 * i);
+    }
+
+    __attribute__((target("avx2")))
+    __m256i nibbles_avx2(const __m256i text, __m256i & error)
+    {
+        const __m256i lower = _mm256_or_si256(text, _mm256_set1_epi8(0x20));
+        const __m256i is_digit = _mm256_andnot_si256(_mm256_cmpgt_epi8(text, _mm256_set1_epi8('9')),
+            _mm256_cmpgt_epi8(text, _mm256_set1_epi8('0' - 1)));
+        const __m256i is_alpha = _mm256_andnot_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('f')),
+            _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)));
+        error = _mm256_or_si256(error, _mm256_xor_si256(_mm256_or_si256(is_digit, is_alpha), _mm256_set1_epi8(-1)));
+
+        const __m256i digit = _mm256_and_si256(is_digit, _mm256_sub_epi8(text, _mm256_set1_epi8('0')));
+        const __m256i alpha = _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)));
+        return _mm256_or_si256(digit, alpha);
+    }
+
+    __attribute__((target("avx2")))
+    bool decode_avx2(const uint8_t * hex, const size_t length, uint8_t * bin)
+    {
+        const __m256i weights = _mm256_set1_epi16(0x0110);
+        __m256i error = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 64 <= length; i += 64)
+        {
+            const __m256i a = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hex + i)), error);
+            const __m256i b = nibbles_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(hex + i + 32)), error);
+            // pack interleaves the 64-bit halves of a and b per lane, put them back in order
+            const __m256i bytes = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights), _mm256_maddubs_epi16(b, weights));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(bin + i / 2), _mm256_permute4x64_epi64(bytes, 0xD8));
+        }
+
+        const bool tail = decode_ssse3(hex + i, length - i, bin + i / 2);
+        return tail && _mm256_movemask_epi8(error) == 0;
+    }
+
+    bool cpu_supports(const bin2hex::kernel_t kernel)
+    {
+        unsigned eax, ebx, ecx, edx;
+        if (kernel == bin2hex::SCALAR) {
+            return true;
+        }
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3)) {
+            return false;
+        }
+
+        if (kernel == bin2hex::SSSE3) {
+            return true;
+        }
+
+        // ymm state has to be saved by the OS (XCR0 SSE and AVX bits)
+        if (!(ecx & bit_OSXSAVE)) {
+            return false;
+        }
+
+        unsigned xcr0_lo, xcr0_hi;
+        __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo & 0x06) != 0x06) {
+            return false;
+        }
+
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+    }
+#else
+    bool cpu_supports(const bin2hex::kernel_t kernel) { return kernel == bin2hex::SCALAR; }
+#endif
+
+    using encode_t = void (*)(const uint8_t *, size_t, char *);
+    using decode_t = bool (*)(const uint8_t *, size_t, uint8_t *);
+
+    encode_t encoder(const bin2hex::kernel_t kernel)
+    {
+        switch (kernel)
+        {
+#if defined(__x86_64__)
+            case bin2hex::AVX2: return encode_avx2;
+            case bin2hex::SSSE3: return encode_ssse3;
+#endif
+            default: return encode_scalar;
+        }
+    }
+
+    decode_t decoder(const bin2hex::kernel_t kernel)
+    {
+        switch (kernel)
+        {
+#if defined(__x86_64__)
+            case bin2hex::AVX2: return decode_avx2;
+            case bin2hex::SSSE3: return decode_ssse3;
+#endif
+            default: return decode_scalar;
+        }
+    }
+
+    // picked once, by cpuid
+    const bin2hex::kernel_t best_kernel = [] {
+        for (const auto kernel : { bin2hex::AVX2, bin2hex::SSSE3 }) {
+            if (cpu_supports(kernel)) return kernel;
+        }
+        return bin2hex::SCALAR;
+    }();
+    const encode_t best_encode = encoder(best_kernel);
+    const decode_t best_decode = decoder(best_kernel);
+}
 
 namespace bin2hex {
-    char hex_table [] = {
-        '0', 0x00,
-        '1', 0x01,
-        '2', 0x02,
-        '3', 0x03,
-        '4', 0x04,
-        '5', 0x05,
-        '6', 0x06,
-        '7', 0x07,
-        '8', 0x08,
-        '9', 0x09,
-        'a', 0x0A,
-        'b', 0x0B,
-        'c', 0x0C,
-        'd', 0x0D,
-        'e', 0x0E,
-        'f', 0x0F,
-    };
+    void encode(const void * bin, const size_t length, char * hex)
+    {
+        best_encode(static_cast<const uint8_t *>(bin), length, hex);
+    }
 
-    void c_bin2hex(const char bin, char hex[2])
+    bool decode(const char * hex, const size_t length, void * bin)
+    {
+        return length % 2 == 0 && best_decode(reinterpret_cast<const uint8_t *>(hex), length, static_cast<uint8_t *>(bin));
+    }
+
+    kernel_t active_kernel()
+    {
+        return best_kernel;
+    }
+
+    bool kernel_supported(const kernel_t kernel)
     {
-        auto find_in_table = [](const char p_hex) -> char {
-            for (size_t i = 0; i < sizeof(hex_table); i += 2) {
-                if (hex_table[i + 1] == p_hex) {
-                    return hex_table[i];
-                }
-            }
+        return cpu_supports(kernel);
+    }
 
-            throw std::invalid_argument("Invalid binary code");
-        };
+    void encode_with(const kernel_t kernel, const void * bin, const size_t length, char * hex)
+    {
+        encoder(kernel)(static_cast<const uint8_t *>(bin), length, hex);
+    }
 
-        const char bin_a = static_cast<char>(bin >> 4) & 0x0F;
-        const char bin_b = bin & 0x0F;
+    bool decode_with(const kernel_t kernel, const char * hex, const size_t length, void * bin)
+    {
+        return length % 2 == 0
+            && decoder(kernel)(reinterpret_cast<const uint8_t *>(hex), length, static_cast<uint8_t *>(bin));
+    }
 
-        hex[0] = find_in_table(bin_a);
-        hex[1] = find_in_table(bin_b);
+    void c_bin2hex(const char bin, char hex[2])
+    {
+        encode_scalar(reinterpret_cast<const uint8_t *>(&bin), 1, hex);
     }
 
-    std::string bin2hex(const std::vector < char > & vec)
+    std::string bin2hex(const std::string_view bin)
     {
-        int cur_line_char_num = 0;
+        std::string result(bin.size() * 2, '\0');
+        encode(bin.data(), bin.size(), result.data());
+        return result;
+    }
 
-        std::string result;
-        char buffer [3] { };
-        for (const auto & bin : vec) {
-            c_bin2hex(bin, buffer);
-            result += buffer;
-            cur_line_char_num += 2;
+    std::vector < char > hex2bin(const std::string_view hex)
+    {
+        if (hex.size() % 2 != 0) {
+            throw std::invalid_argument("Odd hex string length");
+        }
 
-            if (cur_line_char_num == max_line_char_num) {
-                result += "\n";
-                cur_line_char_num = 0;
-            }
+        std::vector < char > result(hex.size() / 2);
+        if (!decode(hex.data(), hex.size(), result.data())) {
+            throw std::invalid_argument("Invalid hex code");
         }
 
         return result;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,111 @@
+/* block_buffer.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <mutex>
+#include "core/block_buffer.h"
+#include "helper/cpp_assert.h"
+
+// idle buffers kept around for reuse, 16MB worth of blocks
+constexpr size_t pool_limit = 256;
+
+namespace {
+    std::mutex pool_mutex;
+    block_buffer_t::storage_t * free_list = nullptr;
+    size_t free_count = 0;
+}
+
+block_buffer_t block_buffer_t::allocate(const uint32_t size)
+{
+    assert_short(size <= BLOCK_SIZE);
+    storage_t * storage = nullptr;
+    {
+        std::lock_guard lock(pool_mutex);
+        if (free_list)
+        {
+            storage = free_list;
+            free_list = storage->next;
+            free_count--;
+        }
+    }
+
+    if (!storage) {
+        storage = new storage_t;
+    }
+
+    storage->references.store(1, std::memory_order_relaxed);
+    storage->size = size;
+    storage->next = nullptr;
+    return block_buffer_t(storage);
+}
+
+void block_buffer_t::release()
+{
+    if (!storage_) {
+        return;
+    }
+
+    if (storage_->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        std::unique_lock lock(pool_mutex);
+        if (free_count < pool_limit)
+        {
+            storage_->next = free_list;
+            free_list = storage_;
+            free_count++;
+        }
+        else
+        {
+            lock.unlock();
+            delete storage_;
+        }
+    }
+
+    storage_ = nullptr;
+}
+
+block_buffer_t & block_buffer_t::operator=(const block_buffer_t & other)
+{
+    if (this != &other)
+    {
+        if (other.storage_) other.storage_->references.fetch_add(1, std::memory_order_relaxed);
+        release();
+        storage_ = other.storage_;
+    }
+
+    return *this;
+}
+
+block_buffer_t & block_buffer_t::operator=(block_buffer_t && other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        storage_ = other.storage_;
+        other.storage_ = nullptr;
+    }
+
+    return *this;
+}
+
+void block_buffer_t::resize(const uint32_t size)
+{
+    assert_short(storage_ && size <= BLOCK_SIZE);
+    storage_->size = size;
+}
@@ -0,0 +1,95 @@
+/* block_key.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <bit>
+#include <cstring>
+#include "core/block_key.h"
+#include "core/bin2hex.h"
+#include "core/crc64sum.h"
+#include "helper/err_type.h"
+#include "helper/xxhash.h"
+
+block_key_t block_key_of(const char * data, const size_t length, const block_hash_t algorithm)
+{
+    if (algorithm == BLOCK_HASH_CRC64)
+    {
+        CRC64 checksum;
+        checksum.update(reinterpret_cast<const uint8_t *>(data), length);
+        return { .lo = checksum.get_raw_checksum(), .hi = 0 };
+    }
+
+    const XXH128_hash_t hash = XXH3_128bits(data, length);
+    return { .lo = hash.low64, .hi = hash.high64 };
+}
+
+block_hash_t block_hash_from_name(const std::string & name)
+{
+    if (name == "crc64") {
+        return BLOCK_HASH_CRC64;
+    }
+
+    if (name == "xxh3_128") {
+        return BLOCK_HASH_XXH3_128;
+    }
+
+    throw runtime_error("Unknown block hash algorithm: " + name);
+}
+
+const char * block_hash_name(const block_hash_t algorithm)
+{
+    return algorithm == BLOCK_HASH_CRC64 ? "crc64" : "xxh3_128";
+}
+
+size_t block_key_to_name(const block_key_t & key, char (&name)[BLOCK_NAME_MAX])
+{
+    if (key.hi == 0)
+    {
+        bin2hex::encode(&key.lo, sizeof(key.lo), name);
+        return sizeof(key.lo) * 2;
+    }
+
+    // XXH128 canonical form, high half first, both big-endian
+    const uint64_t canonical[2] = { std::byteswap(key.hi), std::byteswap(key.lo) };
+    bin2hex::encode(canonical, sizeof(canonical), name);
+    return BLOCK_NAME_MAX;
+}
+
+std::string block_key_to_name(const block_key_t & key)
+{
+    char name[BLOCK_NAME_MAX];
+    return { name, block_key_to_name(key, name) };
+}
+
+bool block_name_to_key(const std::string_view name, block_key_t & key)
+{
+    if (name.size() == sizeof(uint64_t) * 2)
+    {
+        key = { };
+        return bin2hex::decode(name.data(), name.size(), &key.lo);
+    }
+
+    uint64_t canonical[2];
+    if (name.size() != BLOCK_NAME_MAX || !bin2hex::decode(name.data(), name.size(), canonical)) {
+        return false;
+    }
+
+    key = { .lo = std::byteswap(canonical[1]), .hi = std::byteswap(canonical[0]) };
+    return true;
+}
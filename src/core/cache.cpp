@@ -1 +1,287 @@
+/* cache.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <bit>
 #include "core/cache.h"
+#include "helper/log.h"
+
+block_cache_t g_block_cache;
+
+// share of a shard's budget, the rest is the main region
+constexpr uint64_t window_percent = 1;
+constexpr uint64_t protected_percent = 80;     // of the main region
+
+uint64_t block_cache_t::mix(const block_key_t & block_key)
+{
+    // murmur3 finalizer, the same spreading the block index uses
+    uint64_t key = block_key.lo ^ (block_key.hi * 0x9E3779B97F4A7C15ULL);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void block_cache_t::frequency_sketch_t::resize(const size_t entries)
+{
+    // a few counters per cached entry keeps collisions low, 4 rows of them
+    const size_t width = std::bit_ceil(std::max < size_t > (entries * 4, 16));
+    table_.assign(width * 4, 0);
+    mask_ = width - 1;
+    additions_ = 0;
+    sample_size_ = std::max < size_t > (entries * 10, 16);
+}
+
+void block_cache_t::frequency_sketch_t::increment(const uint64_t hash)
+{
+    if (table_.empty()) {
+        return;
+    }
+
+    const uint64_t step = (hash >> 32) | 1;
+    for (size_t row = 0; row < 4; row++)
+    {
+        uint8_t & counter = table_[row * (mask_ + 1) + ((hash + row * step) & mask_)];
+        if (counter < 15) counter++;
+    }
+
+    if (++additions_ == sample_size_)
+    {
+        for (auto & counter : table_) counter >>= 1;
+        additions_ /= 2;
+    }
+}
+
+unsigned block_cache_t::frequency_sketch_t::frequency(const uint64_t hash) const
+{
+    if (table_.empty()) {
+        return 0;
+    }
+
+    const uint64_t step = (hash >> 32) | 1;
+    unsigned frequency = 15;
+    for (size_t row = 0; row < 4; row++) {
+        frequency = std::min < unsigned > (frequency, table_[row * (mask_ + 1) + ((hash + row * step) & mask_)]);
+    }
+
+    return frequency;
+}
+
+block_cache_t::list_t & block_cache_t::list_of(shard_t & shard, const segment_t segment)
+{
+    switch (segment)
+    {
+        case WINDOW: return shard.window;
+        case PROBATION: return shard.probation;
+        default: return shard.protected_;
+    }
+}
+
+uint64_t & block_cache_t::bytes_of(shard_t & shard, const segment_t segment)
+{
+    switch (segment)
+    {
+        case WINDOW: return shard.window_bytes;
+        case PROBATION: return shard.probation_bytes;
+        default: return shard.protected_bytes;
+    }
+}
+
+// to the front of another (or the same) segment
+void block_cache_t::move(shard_t & shard, const list_t::iterator entry, const segment_t to)
+{
+    const uint64_t size = charge(entry->block);
+    bytes_of(shard, entry->segment) -= size;
+    bytes_of(shard, to) += size;
+    list_of(shard, to).splice(list_of(shard, to).begin(), list_of(shard, entry->segment), entry);
+    entry->segment = to;
+}
+
+void block_cache_t::remove(shard_t & shard, const list_t::iterator entry)
+{
+    bytes_of(shard, entry->segment) -= charge(entry->block);
+    shard.entries.erase(entry->key);
+    list_of(shard, entry->segment).erase(entry);
+}
+
+void block_cache_t::enforce_capacity(shard_t & shard)
+{
+    // at least one block, so a new block can be read again before it has to compete for the main region
+    const uint64_t window_capacity = std::min(std::max(shard.capacity * window_percent / 100, footprint), shard.capacity);
+    const uint64_t main_capacity = shard.capacity - window_capacity;
+    const uint64_t protected_capacity = main_capacity * protected_percent / 100;
+
+    // blocks leaving the window compete with the coldest block of the main region
+    while (shard.window_bytes > window_capacity)
+    {
+        const auto candidate = std::prev(shard.window.end());
+        const uint64_t size = charge(candidate->block);
+        if (shard.probation_bytes + shard.protected_bytes + size <= main_capacity)
+        {
+            move(shard, candidate, PROBATION);
+            shard.stats.admitted++;
+            continue;
+        }
+
+        list_t & victims = shard.probation.empty() ? shard.protected_ : shard.probation;
+        if (!victims.empty())
+        {
+            const auto victim = std::prev(victims.end());
+            if (shard.sketch.frequency(mix(candidate->key)) > shard.sketch.frequency(mix(victim->key)))
+            {
+                remove(shard, victim);
+                shard.stats.evicted++;
+                continue;
+            }
+        }
+
+        remove(shard, candidate);
+        shard.stats.rejected++;
+    }
+
+    // after a shrink the main region can be over budget as well
+    while (shard.probation_bytes + shard.protected_bytes > main_capacity)
+    {
+        remove(shard, std::prev(shard.probation.empty() ? shard.protected_.end() : shard.probation.end()));
+        shard.stats.evicted++;
+    }
+
+    while (shard.protected_bytes > protected_capacity) {
+        move(shard, std::prev(shard.protected_.end()), PROBATION);
+    }
+}
+
+void block_cache_t::resize(const uint64_t capacity)
+{
+    capacity_.store(capacity, std::memory_order_relaxed);
+    if (capacity != 0 && capacity < min_capacity()) {
+        warning_log("Block cache of ", capacity / 1024, "KB is too small to keep blocks, it needs at least ", min_capacity() / 1024, "KB");
+    }
+
+    const uint64_t shard_capacity = capacity / shards_.size();
+    for (auto & shard : shards_)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.capacity = shard_capacity;
+        shard.sketch.resize(shard_capacity / BLOCK_SIZE);
+        enforce_capacity(shard);
+    }
+}
+
+bool block_cache_t::lookup(const block_key_t & key, block_buffer_t & block)
+{
+    if (!enabled()) {
+        return false;
+    }
+
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::lock_guard lock(shard.mutex);
+
+    // misses count too, a block read often enough wins its way in once it is inserted
+    shard.sketch.increment(hash);
+    const auto it = shard.entries.find(key);
+    if (it == shard.entries.end())
+    {
+        shard.stats.misses++;
+        return false;
+    }
+
+    const auto entry = it->second;
+    switch (entry->segment)
+    {
+        case WINDOW:
+            move(shard, entry, WINDOW);
+            break;
+        case PROBATION:
+            // a second hit makes it part of the working set
+            move(shard, entry, PROTECTED);
+            enforce_capacity(shard);
+            break;
+        case PROTECTED:
+            move(shard, entry, PROTECTED);
+            break;
+    }
+
+    shard.stats.hits++;
+    block = entry->block;
+    return true;
+}
+
+void block_cache_t::insert(const block_key_t & key, const block_buffer_t & block)
+{
+    if (!enabled() || !block) {
+        return;
+    }
+
+    const uint64_t hash = mix(key);
+    shard_t & shard = shard_of(hash);
+    std::lock_guard lock(shard.mutex);
+    if (charge(block) > shard.capacity || shard.entries.contains(key)) {
+        return;
+    }
+
+    shard.window.push_front({ .key = key, .block = block, .segment = WINDOW });
+    shard.window_bytes += charge(block);
+    shard.entries.emplace(key, shard.window.begin());
+    enforce_capacity(shard);
+}
+
+void block_cache_t::erase(const block_key_t & key)
+{
+    shard_t & shard = shard_of(mix(key));
+    std::lock_guard lock(shard.mutex);
+    if (const auto it = shard.entries.find(key); it != shard.entries.end()) {
+        remove(shard, it->second);
+    }
+}
+
+void block_cache_t::clear()
+{
+    for (auto & shard : shards_)
+    {
+        std::lock_guard lock(shard.mutex);
+        shard.entries.clear();
+        shard.window.clear();
+        shard.probation.clear();
+        shard.protected_.clear();
+        shard.window_bytes = shard.probation_bytes = shard.protected_bytes = 0;
+    }
+}
+
+block_cache_t::stats_t block_cache_t::stats()
+{
+    stats_t total;
+    for (auto & shard : shards_)
+    {
+        std::lock_guard lock(shard.mutex);
+        total.hits += shard.stats.hits;
+        total.misses += shard.stats.misses;
+        total.admitted += shard.stats.admitted;
+        total.rejected += shard.stats.rejected;
+        total.evicted += shard.stats.evicted;
+        total.entries += shard.entries.size();
+        total.bytes += shard.window_bytes + shard.probation_bytes + shard.protected_bytes;
+    }
+
+    return total;
+}
@@ -0,0 +1,127 @@
+/* chunker.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include "core/chunker.h"
+#include "helper/cpp_assert.h"
+
+namespace {
+    // splitmix64, any fixed random table works but it has to be the same on every machine
+    constexpr std::array < uint64_t, 256 > make_gear(const unsigned shift)
+    {
+        std::array < uint64_t, 256 > table { };
+        uint64_t state = 0x4643444346434443ULL;
+        for (auto & entry : table)
+        {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            entry = (z ^ (z >> 31)) << shift;
+        }
+
+        return table;
+    }
+
+    constexpr auto gear = make_gear(0);
+    constexpr auto gear_shifted = make_gear(1);
+
+    // the bits that see the most bytes, bit 63 stays out so the mask survives the shift by one
+    constexpr uint64_t top_bits(const unsigned bits)
+    {
+        return ((1ULL << bits) - 1) << (63 - bits);
+    }
+}
+
+fastcdc_t::fastcdc_t() : fastcdc_t(params_t { })
+{
+}
+
+fastcdc_t::fastcdc_t(const params_t params) : params_(params)
+{
+    assert_throw(params.min_size < params.avg_size && params.avg_size < params.max_size && params.max_size <= BLOCK_SIZE,
+        "Chunk sizes have to satisfy min < avg < max <= " + std::to_string(BLOCK_SIZE));
+    const unsigned bits = std::bit_width(params.avg_size) - 1;
+    assert_throw(bits > 2 && bits + 2 < 63, "Average chunk size out of range");
+    mask_small_ = top_bits(bits + 2);
+    mask_large_ = top_bits(bits - 2);
+}
+
+size_t fastcdc_t::cut(const uint8_t * data, const size_t length) const
+{
+    if (length <= params_.min_size) {
+        return length;
+    }
+
+    const size_t end = std::min < size_t > (length, params_.max_size);
+    const size_t normal = std::min < size_t > (end, params_.avg_size);
+    uint64_t hash = 0;
+    size_t i = params_.min_size;
+
+    // (hash << 2) + gear_shifted[a] is the hash after a, shifted left by one, and tested with a shifted mask
+    const auto scan = [&](const size_t until, const uint64_t mask) -> bool
+    {
+        for (; i + 2 <= until; i += 2)
+        {
+            hash = (hash << 2) + gear_shifted[data[i]];
+            if (!(hash & (mask << 1))) {
+                i += 1;
+                return true;
+            }
+
+            hash += gear[data[i + 1]];
+            if (!(hash & mask)) {
+                i += 2;
+                return true;
+            }
+        }
+
+        if (i < until)
+        {
+            hash = (hash << 1) + gear[data[i++]];
+            if (!(hash & mask)) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    if (scan(normal, mask_small_) || scan(end, mask_large_)) {
+        return i;
+    }
+
+    return end;
+}
+
+std::vector < uint32_t > fastcdc_t::split(const uint8_t * data, const size_t length) const
+{
+    std::vector < uint32_t > chunks;
+    chunks.reserve(length / params_.avg_size + 1);
+    for (size_t offset = 0; offset < length;)
+    {
+        const size_t chunk = cut(data + offset, length - offset);
+        chunks.push_back(static_cast<uint32_t>(chunk));
+        offset += chunk;
+    }
+
+    return chunks;
+}
@@ -18,24 +18,285 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cstdint>
 #include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "core/bin2hex.h"
 #include "core/crc64sum.h"
+#include "helper/err_type.h"
+
+#if defined(__x86_64__)
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
 
 #ifdef __unix__
 # undef LITTLE_ENDIAN
 # undef BIG_ENDIAN
 #endif // __unix__
 
-CRC64::CRC64() {
-    init_crc64();
+namespace {
+    constexpr uint64_t crc64_polynomial = 0xC96C5795D7870F42;  // Standard CRC-64 polynomial, reflected
+    constexpr size_t slices = 16;
+
+    /* table[0] is the classic byte-at-a-time table, table[k][i] is the CRC of byte i followed by k zero bytes,
+     * so the 16 lookups of one step can be XORed together independently */
+    consteval std::array < std::array < uint64_t, 256 >, slices > make_crc64_tables()
+    {
+        std::array < std::array < uint64_t, 256 >, slices > table{};
+        for (uint64_t i = 0; i < 256; ++i) {
+            uint64_t crc = i;
+            for (uint64_t j = 8; j--; ) {
+                crc = (crc & 1) ? (crc >> 1) ^ crc64_polynomial : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+
+        for (size_t k = 1; k < slices; ++k) {
+            for (size_t i = 0; i < 256; ++i) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+            }
+        }
+
+        return table;
+    }
+
+    constexpr auto crc64_table = make_crc64_tables();
+
+    uint64_t crc64_update_table(uint64_t crc, const uint8_t * data, size_t length)
+    {
+        if constexpr (std::endian::native == std::endian::little)
+        {
+            const auto & t = crc64_table;
+            for (; length >= slices; data += slices, length -= slices)
+            {
+                uint64_t lo, hi;
+                std::memcpy(&lo, data, sizeof(lo));
+                std::memcpy(&hi, data + sizeof(lo), sizeof(hi));
+                lo ^= crc;
+                crc = t[15][lo & 0xFF] ^ t[14][(lo >> 8) & 0xFF] ^ t[13][(lo >> 16) & 0xFF] ^ t[12][(lo >> 24) & 0xFF]
+                    ^ t[11][(lo >> 32) & 0xFF] ^ t[10][(lo >> 40) & 0xFF] ^ t[9][(lo >> 48) & 0xFF] ^ t[8][lo >> 56]
+                    ^ t[7][hi & 0xFF] ^ t[6][(hi >> 8) & 0xFF] ^ t[5][(hi >> 16) & 0xFF] ^ t[4][(hi >> 24) & 0xFF]
+                    ^ t[3][(hi >> 32) & 0xFF] ^ t[2][(hi >> 40) & 0xFF] ^ t[1][(hi >> 48) & 0xFF] ^ t[0][hi >> 56];
+            }
+        }
+
+        for (size_t i = 0; i < length; ++i) {
+            crc = crc64_table[0][(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    /* Carry-less multiply folding (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ").
+     * A 128-bit lane holding message bits H:L is moved D bits further down the message by
+     *   H * (x^(D+64) mod P) + L * (x^D mod P)
+     * Operands are bit-reflected, which makes PCLMULQDQ return the product times x, hence the exponents
+     * below are one less. Once everything is folded into one lane, that lane is just 16 more message bytes
+     * for the table code, which does the final reduction. */
+    constexpr uint64_t crc64_polynomial_normal = 0x42F0E1EBA9EA3693;
+
+    consteval uint64_t reflect64(uint64_t x)
+    {
+        uint64_t r = 0;
+        for (int i = 0; i < 64; i++, x >>= 1) r = (r << 1) | (x & 1);
+        return r;
+    }
+
+    consteval uint64_t xpow_mod(const unsigned n)    // x^n mod P
+    {
+        uint64_t r = 1;
+        for (unsigned i = 0; i < n; i++) r = (r << 1) ^ ((r >> 63) ? crc64_polynomial_normal : 0);
+        return r;
+    }
+
+    struct fold_constant_t { uint64_t lo, hi; };
+    consteval fold_constant_t fold_constant(const unsigned bits)
+    {
+        return { reflect64(xpow_mod(bits + 63)), reflect64(xpow_mod(bits - 1)) };
+    }
+
+    constexpr fold_constant_t fold_128  = fold_constant(128);
+    constexpr fold_constant_t fold_512  = fold_constant(512);
+    constexpr fold_constant_t fold_2048 = fold_constant(2048);
+
+    __attribute__((target("pclmul,sse2")))
+    __m128i fold(const __m128i x, const __m128i k)
+    {
+        return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11));
+    }
+
+    // fold the rest 16 bytes at a time into x, reduce, and hand the tail to the table code
+    __attribute__((target("pclmul,sse2")))
+    uint64_t pclmul_finish(__m128i x, const uint8_t * data, size_t length)
+    {
+        const __m128i k128 = _mm_set_epi64x(static_cast<int64_t>(fold_128.hi), static_cast<int64_t>(fold_128.lo));
+        for (; length >= 16; data += 16, length -= 16) {
+            x = _mm_xor_si128(fold(x, k128), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data)));
+        }
+
+        alignas(16) uint8_t lane[16];
+        _mm_store_si128(reinterpret_cast<__m128i *>(lane), x);
+        return crc64_update_table(crc64_update_table(0, lane, sizeof(lane)), data, length);
+    }
+
+    __attribute__((target("pclmul,sse2")))
+    uint64_t crc64_update_pclmul(const uint64_t crc, const uint8_t * data, size_t length)
+    {
+        if (length < 64) {
+            return crc64_update_table(crc, data, length);
+        }
+
+        const auto load = [](const uint8_t * p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); };
+        const __m128i k128 = _mm_set_epi64x(static_cast<int64_t>(fold_128.hi), static_cast<int64_t>(fold_128.lo));
+        const __m128i k512 = _mm_set_epi64x(static_cast<int64_t>(fold_512.hi), static_cast<int64_t>(fold_512.lo));
+
+        // the running CRC is XORed into the first 8 message bytes
+        __m128i x0 = _mm_xor_si128(load(data), _mm_cvtsi64_si128(static_cast<int64_t>(crc)));
+        __m128i x1 = load(data + 16), x2 = load(data + 32), x3 = load(data + 48);
+        data += 64; length -= 64;
+
+        // four independent lanes hide the multiply latency
+        for (; length >= 64; data += 64, length -= 64)
+        {
+            x0 = _mm_xor_si128(fold(x0, k512), load(data));
+            x1 = _mm_xor_si128(fold(x1, k512), load(data + 16));
+            x2 = _mm_xor_si128(fold(x2, k512), load(data + 32));
+            x3 = _mm_xor_si128(fold(x3, k512), load(data + 48));
+        }
+
+        x1 = _mm_xor_si128(fold(x0, k128), x1);
+        x2 = _mm_xor_si128(fold(x1, k128), x2);
+        x3 = _mm_xor_si128(fold(x2, k128), x3);
+        return pclmul_finish(x3, data, length);
+    }
+
+    __attribute__((target("avx512f,vpclmulqdq,pclmul")))
+    __m512i fold(const __m512i x, const __m512i k)
+    {
+        return _mm512_xor_si512(_mm512_clmulepi64_epi128(x, k, 0x00), _mm512_clmulepi64_epi128(x, k, 0x11));
+    }
+
+    __attribute__((target("avx512f,vpclmulqdq,pclmul")))
+    uint64_t crc64_update_vpclmul(const uint64_t crc, const uint8_t * data, size_t length)
+    {
+        if (length < 512) {
+            return crc64_update_pclmul(crc, data, length);
+        }
+
+        const auto k512_lo = static_cast<int64_t>(fold_512.lo), k512_hi = static_cast<int64_t>(fold_512.hi);
+        const auto k2048_lo = static_cast<int64_t>(fold_2048.lo), k2048_hi = static_cast<int64_t>(fold_2048.hi);
+        const __m512i k512 = _mm512_set_epi64(k512_hi, k512_lo, k512_hi, k512_lo, k512_hi, k512_lo, k512_hi, k512_lo);
+        const __m512i k2048 = _mm512_set_epi64(k2048_hi, k2048_lo, k2048_hi, k2048_lo, k2048_hi, k2048_lo, k2048_hi, k2048_lo);
+
+        __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(data), _mm512_zextsi128_si512(_mm_cvtsi64_si128(static_cast<int64_t>(crc))));
+        __m512i x1 = _mm512_loadu_si512(data + 64), x2 = _mm512_loadu_si512(data + 128), x3 = _mm512_loadu_si512(data + 192);
+        data += 256; length -= 256;
+
+        // 16 lanes of 128 bits, 256 bytes per iteration
+        for (; length >= 256; data += 256, length -= 256)
+        {
+            x0 = _mm512_xor_si512(fold(x0, k2048), _mm512_loadu_si512(data));
+            x1 = _mm512_xor_si512(fold(x1, k2048), _mm512_loadu_si512(data + 64));
+            x2 = _mm512_xor_si512(fold(x2, k2048), _mm512_loadu_si512(data + 128));
+            x3 = _mm512_xor_si512(fold(x3, k2048), _mm512_loadu_si512(data + 192));
+        }
+
+        x1 = _mm512_xor_si512(fold(x0, k512), x1);
+        x2 = _mm512_xor_si512(fold(x1, k512), x2);
+        x3 = _mm512_xor_si512(fold(x2, k512), x3);
+
+        // the four lanes of x3 are 64 consecutive message bytes
+        alignas(64) __m128i lanes[4];
+        _mm512_store_si512(lanes, x3);
+        const __m128i k128 = _mm_set_epi64x(static_cast<int64_t>(fold_128.hi), static_cast<int64_t>(fold_128.lo));
+        __m128i x = lanes[0];
+        for (int i = 1; i < 4; i++) {
+            x = _mm_xor_si128(fold(x, k128), lanes[i]);
+        }
+
+        return pclmul_finish(x, data, length);
+    }
+
+    bool cpu_supports(const CRC64::kernel_t kernel)
+    {
+        unsigned eax, ebx, ecx, edx;
+        if (kernel == CRC64::TABLE) {
+            return true;
+        }
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_PCLMUL)) {
+            return false;
+        }
+
+        if (kernel == CRC64::PCLMUL) {
+            return true;
+        }
+
+        // VPCLMULQDQ on zmm needs AVX-512F, and the OS has to save the zmm state (XCR0 opmask/ZMM bits)
+        if (!(ecx & bit_OSXSAVE)) {
+            return false;
+        }
+
+        unsigned xcr0_lo, xcr0_hi;
+        __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo & 0xE6) != 0xE6) {
+            return false;
+        }
+
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX512F) && (ecx & bit_VPCLMULQDQ);
+    }
+#else
+    bool cpu_supports(const CRC64::kernel_t kernel) { return kernel == CRC64::TABLE; }
+#endif
+
+    using crc64_update_t = uint64_t (*)(uint64_t, const uint8_t *, size_t);
+    crc64_update_t kernel_function(const CRC64::kernel_t kernel)
+    {
+        switch (kernel)
+        {
+#if defined(__x86_64__)
+            case CRC64::VPCLMUL: return crc64_update_vpclmul;
+            case CRC64::PCLMUL: return crc64_update_pclmul;
+#endif
+            default: return crc64_update_table;
+        }
+    }
+
+    // picked once, by cpuid
+    const CRC64::kernel_t best_kernel = [] {
+        for (const auto kernel : { CRC64::VPCLMUL, CRC64::PCLMUL }) {
+            if (cpu_supports(kernel)) return kernel;
+        }
+        return CRC64::TABLE;
+    }();
+    const crc64_update_t best_update = kernel_function(best_kernel);
 }
 
 void CRC64::update(const uint8_t* data, const size_t length) {
-    for (size_t i = 0; i < length; ++i) {
-        crc64_value = table[(crc64_value ^ data[i]) & 0xFF] ^ (crc64_value >> 8);
-    }
+    crc64_value = best_update(crc64_value, data, length);
+}
+
+CRC64::kernel_t CRC64::active_kernel()
+{
+    return best_kernel;
+}
+
+bool CRC64::kernel_supported(const kernel_t kernel)
+{
+    return cpu_supports(kernel);
+}
+
+uint64_t CRC64::update_with(const kernel_t kernel, const uint64_t crc, const uint8_t * data, const size_t length)
+{
+    return kernel_function(kernel)(crc, data, length);
 }
 
 [[nodiscard]] uint64_t CRC64::get_checksum(const endian_t endian
@@ -49,24 +310,9 @@ void CRC64::update(const uint8_t* data, const size_t length) {
 
 [[nodiscard]] std::string CRC64::get_checksum_str() const
 {
-    std::vector<char> bytes(sizeof(crc64_value));
-    std::memcpy(bytes.data(), &crc64_value, sizeof(crc64_value));
-    return bin2hex::bin2hex(bytes);
-}
-
-void CRC64::init_crc64()
-{
-    crc64_value = 0xFFFFFFFFFFFFFFFF;
-    for (uint64_t i = 0; i < 256; ++i) {
-        uint64_t crc = i;
-        for (uint64_t j = 8; j--; ) {
-        if (crc & 1)
-            crc = (crc >> 1) ^ 0xC96C5795D7870F42;  // Standard CRC-64 polynomial
-        else
-            crc >>= 1;
-        }
-        table[i] = crc;
-    }
+    std::string hex(sizeof(crc64_value) * 2, '\0');
+    bin2hex::encode(&crc64_value, sizeof(crc64_value), hex.data());
+    return hex;
 }
 
 uint64_t CRC64::reverse_bytes(uint64_t x)
@@ -76,3 +322,198 @@ uint64_t CRC64::reverse_bytes(uint64_t x)
     x = ((x & 0x00FF00FF00FF00FFULL) << 8)  | ((x & 0xFF00FF00FF00FF00ULL) >> 8);
     return x;
 }
+
+/* Combining works on polynomials mod P in the same bit-reflected form as the CRC register,
+ * bit 63 is x^0 and bit 0 is x^63. Appending n zero bytes multiplies the register by x^(8n),
+ * so crc(AB) = crc(A) * x^(8 len(B)) + crc(B), the init and final complements cancel out.
+ * x^(8n) is assembled from the squares x^(2^k) in log(n) multiplications, same as zlib's crc32_combine. */
+namespace {
+    constexpr uint64_t x_pow_0 = 1ULL << 63;
+
+    constexpr uint64_t multiply_mod_p(uint64_t a, uint64_t b)
+    {
+        uint64_t product = 0;
+        for (uint64_t m = x_pow_0; m; m >>= 1)
+        {
+            if (a & m) {
+                product ^= b;
+            }
+
+            b = (b & 1) ? (b >> 1) ^ crc64_polynomial : b >> 1;    // b *= x
+        }
+
+        return product;
+    }
+
+    // x^(2^k) mod P for k = 0..66, starting at x. 64-bit exponents shifted by 3 (bytes to bits) need 67
+    using square_table_t = std::array < uint64_t, 67 >;
+    consteval square_table_t make_square_table(uint64_t x)
+    {
+        square_table_t table{};
+        for (auto & entry : table)
+        {
+            entry = x;
+            x = multiply_mod_p(x, x);
+        }
+
+        return table;
+    }
+
+    constexpr auto x_squares = make_square_table(x_pow_0 >> 1);
+
+    // x^-1 mod P: P = x * Q + 1, so x * Q = 1. Q in reflected form is P shifted one place towards x^0
+    constexpr auto x_inverse_squares = make_square_table((crc64_polynomial << 1) | 1);
+
+    // x^(n * 2^k) mod P, n * 2^k taken from squares
+    uint64_t x_pow_mod_p(uint64_t n, unsigned k, const square_table_t & squares)
+    {
+        uint64_t result = x_pow_0;
+        for (; n; n >>= 1, k++) {
+            if (n & 1) result = multiply_mod_p(squares[k], result);
+        }
+
+        return result;
+    }
+
+    uint64_t shift_bytes(const uint64_t crc, const uint64_t bytes)
+    {
+        return multiply_mod_p(x_pow_mod_p(bytes, 3, x_squares), crc);
+    }
+
+    unsigned worker_count(const unsigned threads, const uint64_t length, const uint64_t min_slice)
+    {
+        const unsigned wanted = threads ? threads : std::max(std::thread::hardware_concurrency(), 1u);
+        return static_cast<unsigned>(std::clamp<uint64_t>(length / min_slice, 1, wanted));
+    }
+
+    // run hash(begin, end) on every slice and fold the slice CRCs together in order
+    template < typename Fn >
+    uint64_t hash_slices(const uint64_t length, const unsigned workers, Fn && hash)
+    {
+        // slices start on block boundaries, so SIMD kernels see aligned strides
+        const uint64_t slice = (length / workers + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        std::vector < uint64_t > crcs(workers, 0);
+        std::vector < std::exception_ptr > errors(workers);
+        std::vector < std::thread > threads;
+        for (unsigned i = 0; i < workers; i++)
+        {
+            threads.emplace_back([&, i] {
+                const uint64_t begin = std::min(length, i * slice), end = std::min(length, begin + slice);
+                try {
+                    crcs[i] = hash(begin, end);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            });
+        }
+
+        for (auto & thread : threads) {
+            thread.join();
+        }
+
+        uint64_t crc = 0;   // CRC of the empty message
+        for (unsigned i = 0; i < workers; i++)
+        {
+            if (errors[i]) {
+                std::rethrow_exception(errors[i]);
+            }
+
+            const uint64_t begin = std::min(length, i * slice);
+            crc = crc64_combine(crc, crcs[i], std::min(length, begin + slice) - begin);
+        }
+
+        return crc;
+    }
+}
+
+uint64_t crc64_combine(const uint64_t crc_a, const uint64_t crc_b, const uint64_t length_b)
+{
+    return shift_bytes(crc_a, length_b) ^ crc_b;
+}
+
+uint64_t crc64_parallel(const uint8_t * data, const size_t length, const unsigned threads)
+{
+    return hash_slices(length, worker_count(threads, length, 1024 * 1024), [data](const uint64_t begin, const uint64_t end)
+    {
+        CRC64 crc;
+        crc.update(data + begin, end - begin);
+        return crc.get_checksum(LITTLE_ENDIAN);
+    });
+}
+
+uint64_t crc64_file(const std::string & path, const unsigned threads)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        throw runtime_error("Cannot stat " + path + ": " + strerror(errno));
+    }
+
+    const auto length = static_cast<uint64_t>(st.st_size);
+    try
+    {
+        const uint64_t crc = hash_slices(length, worker_count(threads, length, 8 * 1024 * 1024),
+            [fd, &path](uint64_t begin, const uint64_t end)
+        {
+            std::vector < uint8_t > buffer(1024 * 1024);
+            CRC64 crc;
+            while (begin < end)
+            {
+                const ssize_t ret = pread(fd, buffer.data(), std::min<uint64_t>(buffer.size(), end - begin), static_cast<off_t>(begin));
+                if (ret <= 0) {
+                    throw runtime_error("Cannot read " + path + ": " + (ret == 0 ? "file shrank" : strerror(errno)));
+                }
+
+                crc.update(buffer.data(), static_cast<size_t>(ret));
+                begin += static_cast<uint64_t>(ret);
+            }
+
+            return crc.get_checksum(LITTLE_ENDIAN);
+        });
+
+        close(fd);
+        return crc;
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+uint64_t crc64_from_blocks(const std::vector < block_key_t > & pages, const uint64_t file_size, const uint64_t block_size)
+{
+    uint64_t crc = 0;
+    uint64_t remaining = file_size;
+    for (const auto & page : pages)
+    {
+        if (remaining == 0) {
+            break;
+        }
+
+        // a CRC64 key is the raw register of its block, an XXH3 key says nothing about the CRC
+        if (page.hi != 0) {
+            throw runtime_error("Block " + block_key_to_name(page) + " is not a CRC64 block key");
+        }
+
+        uint64_t block_crc = page.lo;
+        const uint64_t length = std::min(remaining, block_size);
+        if (length < block_size)
+        {
+            // the last block was hashed with zero padding, appending zeros multiplied the raw register
+            // by x^(8 * padding), so multiply by the inverse to take them off again
+            block_crc = multiply_mod_p(x_pow_mod_p(block_size - length, 3, x_inverse_squares), block_crc);
+        }
+
+        crc = crc64_combine(crc, block_crc ^ 0xFFFFFFFFFFFFFFFFULL, length);
+        remaining -= length;
+    }
+
+    return crc;
+}
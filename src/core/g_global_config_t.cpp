@@ -1,7 +1,226 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include "core/g_global_config_t.h"
+#include "helper/get_env.h"
+#include "helper/log.h"
 
 g_global_config_t g_global_config;
+
+namespace {
+    const std::string * find_value(const configuration::configuration_map_t & values,
+        const std::string & section, const std::string & key)
+    {
+        const auto section_it = values.find(section);
+        if (section_it == values.end()) {
+            return nullptr;
+        }
+
+        const auto key_it = section_it->second.find(key);
+        if (key_it == section_it->second.end()) {
+            return nullptr;
+        }
+
+        assert_throw(key_it->second.size() == 1, "More than one value specified for " + section + "." + key);
+        return &key_it->second.front();
+    }
+
+    std::string get_string(const configuration::configuration_map_t & values,
+        const std::string & section, const std::string & key, const std::string & fallback = "")
+    {
+        const auto value = find_value(values, section, key);
+        return value && !value->empty() ? *value : fallback;
+    }
+
+    bool get_bool(const configuration::configuration_map_t & values,
+        const std::string & section, const std::string & key, const bool fallback)
+    {
+        const auto value = find_value(values, section, key);
+        return value && !value->empty() ? true_false_helper(*value) : fallback;
+    }
+
+    int64_t get_int(const configuration::configuration_map_t & values,
+        const std::string & section, const std::string & key, const int64_t fallback)
+    {
+        const auto value = find_value(values, section, key);
+        if (!value || value->empty()) {
+            return fallback;
+        }
+
+        try {
+            return std::stoll(*value);
+        } catch (const std::exception &) {
+            throw runtime_error("Malformed number for " + section + "." + key + ": " + *value);
+        }
+    }
+
+    // 0 or negative means one per core
+    unsigned get_threads(const configuration::configuration_map_t & values, const std::string & key)
+    {
+        const int64_t threads = get_int(values, "server", key, 0);
+        return static_cast<unsigned>(threads > 0 ? threads : std::thread::hardware_concurrency());
+    }
+}
+
+static std::shared_ptr < const config_snapshot_t > load_snapshot(const std::string & config_file)
+{
+    auto config = std::make_shared<config_snapshot_t>();
+    config->values = configuration(config_file).config;
+    const auto & values = config->values;
+
+    config->debug.verbose = get_bool(values, "debug", "verbose", false);
+    config->debug.backtrace_level = static_cast<int>(get_int(values, "debug", "backtrace_level", 0));
+    config->debug.trim_symbol = get_bool(values, "debug", "trim_symbol", false);
+    config->general.color = get_bool(values, "general", "color", false);
+
+    auto & server = config->server;
+    server.listen_addr = get_string(values, "server", "listen_addr", "127.0.0.1");
+    server.port = static_cast<int>(get_int(values, "server", "port", 8080));
+    assert_throw(server.port > 0 && server.port <= UINT16_MAX, "server.port out of range");
+    server.dictionary = get_string(values, "server", "dictionary");
+    assert_throw(!server.dictionary.empty(), "server.dictionary is not set");
+    const int64_t segment_size = get_int(values, "server", "segment_size", 1024);
+    server.segment_size = static_cast<uint64_t>(segment_size > 0 ? segment_size : 1024) * 1024 * 1024;
+    server.network_threads = std::clamp<unsigned>(get_threads(values, "network_threads"), 2, UINT16_MAX);
+    server.io_threads = get_threads(values, "io_threads");
+    server.io_uring = get_bool(values, "server", "io_uring", true);
+    const int64_t max_inflight = get_int(values, "server", "max_inflight", 64);
+    server.max_inflight = static_cast<unsigned>(max_inflight > 0 ? max_inflight : 64);
+    const int64_t max_queued = get_int(values, "server", "max_queued", 64);
+    server.max_queued = static_cast<uint64_t>(max_queued > 0 ? max_queued : 64) * 1024 * 1024;
+    const std::string block_hash = get_string(values, "server", "block_hash");
+    server.block_hash = block_hash.empty() ? BLOCK_HASH_XXH3_128 : block_hash_from_name(block_hash);
+    const int64_t cache_size = get_int(values, "server", "cache_size", 256);
+    server.cache_size = static_cast<uint64_t>(std::max<int64_t>(cache_size, 0)) * 1024 * 1024;
+    if (!get_bool(values, "server", "local_cache", true)) {
+        server.cache_size = 0;
+    }
+    server.gc_interval = static_cast<uint64_t>(std::max<int64_t>(get_int(values, "server", "gc_interval", 300), 0));
+    const int64_t gc_bandwidth = get_int(values, "server", "gc_bandwidth", 16);
+    server.gc_bandwidth = static_cast<uint64_t>(std::max<int64_t>(gc_bandwidth, 0)) * 1024 * 1024;
+
+    return config;
+}
+
 void g_global_config_t::initialize(const std::string & config_file)
 {
-    config = std::make_unique<configuration>(config_file);
+    auto config = load_snapshot(config_file);
+    std::lock_guard lock(handlers_mutex_);
+    path_ = config_file;
+    snapshot_.store(std::move(config), std::memory_order_release);
+}
+
+bool g_global_config_t::reload()
+{
+    std::lock_guard lock(handlers_mutex_);
+    std::shared_ptr < const config_snapshot_t > after;
+    try {
+        after = load_snapshot(path_);
+    } catch (const std::exception & e) {
+        warning_log("Configuration ", path_, " not reloaded, keeping the current one: ", e.what());
+        return false;
+    }
+
+    const auto before = snapshot_.exchange(after, std::memory_order_acq_rel);
+    verbose_log("Configuration ", path_, " reloaded");
+    for (const auto & handler : handlers_)
+    {
+        try {
+            handler(*before, *after);
+        } catch (const std::exception & e) {
+            warning_log("Cannot apply reloaded configuration: ", e.what());
+        }
+    }
+
+    return true;
+}
+
+void g_global_config_t::on_reload(config_reload_handler_t handler)
+{
+    std::lock_guard lock(handlers_mutex_);
+    handlers_.emplace_back(std::move(handler));
+}
+
+void g_global_config_t::watch()
+{
+    if (watcher_.joinable()) {
+        return;
+    }
+
+    const std::filesystem::path path = std::filesystem::absolute(path_);
+    const int inotify_fd = inotify_init1(IN_CLOEXEC);
+    assert_throw(inotify_fd != -1, std::string("inotify_init1 failed: ") + strerror(errno));
+    if (inotify_add_watch(inotify_fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1)
+    {
+        const int err = errno;
+        close(inotify_fd);
+        throw runtime_error("Cannot watch " + path.parent_path().string() + ": " + strerror(err));
+    }
+
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    assert_throw(stop_fd_ != -1, std::string("eventfd failed: ") + strerror(errno));
+    watcher_ = std::thread([this, inotify_fd] {
+        pthread_setname_np(pthread_self(), "ConfigWatch");
+        watch_loop(inotify_fd);
+        close(inotify_fd);
+    });
+
+    verbose_log("Watching ", path.string(), " for changes");
+}
+
+void g_global_config_t::watch_loop(const int inotify_fd)
+{
+    const std::string name = std::filesystem::path(path_).filename().string();
+    alignas(inotify_event) char buffer[4096];
+    pollfd fds[2] = { { .fd = inotify_fd, .events = POLLIN, .revents = 0 }, { .fd = stop_fd_, .events = POLLIN, .revents = 0 } };
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR) continue;
+            error_log("poll on the config watcher failed");
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            return;
+        }
+
+        const ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        bool changed = false;
+        for (ssize_t offset = 0; offset < length;)
+        {
+            const auto event = reinterpret_cast<const inotify_event *>(buffer + offset);
+            changed |= event->len != 0 && name == event->name;
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+
+        if (!changed) {
+            continue;
+        }
+
+        // an editor save is often several events (truncate, write, rename), let them settle first
+        while (poll(fds, 1, 100) > 0 && read(inotify_fd, buffer, sizeof(buffer)) > 0) { }
+        reload();
+    }
+}
+
+void g_global_config_t::stop_watching()
+{
+    if (!watcher_.joinable()) {
+        return;
+    }
+
+    constexpr uint64_t one = 1;
+    [[maybe_unused]] const auto ret = write(stop_fd_, &one, sizeof(one));
+    watcher_.join();
+    close(stop_fd_);
+    stop_fd_ = -1;
 }
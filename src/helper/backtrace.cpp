@@ -2,9 +2,12 @@
 #include <vector>
 #include <execinfo.h>
 #include <sstream>
-#include <regex>
 #include <cxxabi.h>
-#include <ranges>
+#include <dlfcn.h>
+#include <link.h>
+#include <map>
+#include <shared_mutex>
+#include <unordered_map>
 #include "helper/backtrace.h"
 #include "helper/color.h"
 #include "helper/get_env.h"
@@ -12,8 +15,6 @@
 #include "helper/log.h"
 #include "core/g_global_config_t.h"
 
-#define MAX_STACK_FRAMES (64)
-
 std::string debug::demangle(const char* mangled)
 {
     int status = 0;
@@ -23,26 +24,6 @@ std::string debug::demangle(const char* mangled)
     return result;
 }
 
-typedef std::vector < std::pair<std::string, void*> > backtrace_info;
-backtrace_info obtain_stack_frame()
-{
-    backtrace_info result;
-    void* buffer[MAX_STACK_FRAMES] = {};
-    const int frames = backtrace(buffer, MAX_STACK_FRAMES);
-
-    char** symbols = backtrace_symbols(buffer, frames);
-    if (symbols == nullptr) {
-        return backtrace_info {};
-    }
-
-    for (int i = 1; i < frames; ++i) {
-        result.emplace_back(symbols[i], buffer[i]);
-    }
-
-    free(symbols);
-    return result;
-}
-
 std::atomic_bool debug::g_trim_symbol = false;
 
 bool trim_symbol_yes()
@@ -52,132 +33,225 @@ bool trim_symbol_yes()
         : true_false_helper(get_env(TRIM_SYMBOL));
 }
 
-// fast backtrace
-std::string backtrace_level_1()
-{
-    std::stringstream ss;
-    const backtrace_info frames = obtain_stack_frame();
-    int i = 0;
-    auto trim_sym = [](std::string name)->std::string
+namespace {
+    struct frame_info_t
+    {
+        std::string module;         // executable or shared object holding the address
+        std::string name;           // demangled symbol, or +0x offset into module
+        uintptr_t offset = 0;       // address as addr2line sees it in module
+        std::string function;       // level 2, from the debug info
+        std::string file;           // level 2, source:line
+        bool lines_resolved = false;
+    };
+
+    // code addresses are a bounded set, so the cache is never trimmed
+    std::shared_mutex cache_mutex;
+    std::unordered_map < void *, frame_info_t > frame_cache;
+
+    std::string to_hex(const uintptr_t value)
+    {
+        char buffer[2 + sizeof(value) * 2 + 1];
+        snprintf(buffer, sizeof(buffer), "0x%lx", static_cast<unsigned long>(value));
+        return buffer;
+    }
+
+    // in process, dladdr reads the dynamic symbol tables that are already mapped
+    frame_info_t resolve_symbol(void * address)
     {
-        if (trim_symbol_yes())
+        frame_info_t info;
+        Dl_info dl { };
+        if (dladdr(address, &dl) == 0 || dl.dli_fbase == nullptr)
         {
-            name = std::regex_replace(name, std::regex(R"(\(.*\))"), "");
-            name = std::regex_replace(name, std::regex(R"(\[abi\:.*\])"), "");
-            name = std::regex_replace(name, std::regex(R"(std\:\:.*\:\:)"), "");
-            return name;
+            info.name = to_hex(reinterpret_cast<uintptr_t>(address));
+            return info;
         }
 
-        return name;
-    };
+        // shared objects and PIE executables are linked at 0, fixed position executables where they load
+        const auto * header = static_cast<const ElfW(Ehdr) *>(dl.dli_fbase);
+        const uintptr_t base = header->e_type == ET_DYN ? reinterpret_cast<uintptr_t>(dl.dli_fbase) : 0;
+        info.module = dl.dli_fname ? dl.dli_fname : "";
+        info.offset = reinterpret_cast<uintptr_t>(address) - base;
+        info.name = dl.dli_sname ? debug::demangle(dl.dli_sname) : "+" + to_hex(info.offset);
+        return info;
+    }
 
-    auto get_pair = [](const std::string & name)->std::pair<std::string, std::string>
+    // file and line need the DWARF data, one addr2line per module covers every frame of the trace
+    void resolve_lines(std::vector < frame_info_t * > & frames)
     {
-        const std::regex pattern(R"((.*)\((.*)(\+0x.*)\)\s\[.*\])");
-        if (std::smatch matches; std::regex_search(name, matches, pattern)) {
-            if (matches.size() == 4) {
-                return std::make_pair(matches[1].str(),
-                    matches[2].str().empty() ? matches[3].str() : debug::demangle(matches[2].str().c_str()));
+        std::map < std::string, std::vector < frame_info_t * > > by_module;
+        for (auto * frame : frames)
+        {
+            frame->lines_resolved = true;
+            if (!frame->module.empty()) {
+                by_module[frame->module].push_back(frame);
             }
         }
 
-        return std::make_pair("", name);
-    };
-
-    for (const auto &symbol_name: frames | std::views::keys)
-    {
-        const auto [path, name] = get_pair(symbol_name);
-        ss  << color::color(0,4,1) << "Frame " << color::color(5,2,1) << "#" << i++ << " "
-            << std::hex << color::color(2,4,5) << path
-            << ": " << color::color(1,5,5) << trim_sym(name) << color::no_color() << "\n";
-    }
+        for (const auto & [module, module_frames] : by_module)
+        {
+            std::string addresses;
+            for (const auto * frame : module_frames) {
+                // return addresses point past the call, look up the call itself
+                addresses += to_hex(frame->offset - 1) + "\n";
+            }
 
-    return ss.str();
-}
+            const auto [fd_stdout, fd_stderr, exit_status]
+                = exec_command("/usr/bin/addr2line", addresses, "--demangle", "-f", "-e", module);
+            if (exit_status != 0) {
+                continue;
+            }
 
-// slow backtrace, with better trace info
-std::string backtrace_level_2()
-{
-    std:: stringstream ss;
-    const auto frames = obtain_stack_frame();
-    int i = 0;
-    const std::regex pattern(R"(([^\(]+)\(([^\)]*)\) \[([^\]]+)\])");
-    std::smatch matches;
+            // two lines per address, function then file:line
+            std::istringstream output(fd_stdout);
+            for (auto * frame : module_frames)
+            {
+                std::string function, file;
+                if (!std::getline(output, function) || !std::getline(output, file)) {
+                    break;
+                }
 
-    struct traced_info
-    {
-        std::string name;
-        std::string file;
-    };
+                if (function != "??") frame->function = function;
+                if (file.rfind("??", 0) != 0) frame->file = file;
+            }
+        }
+    }
 
-    auto generate_addr2line_trace_info = [](const std::string & executable_path, const std::string& address)->traced_info
+    std::vector < frame_info_t > symbolize(const debug::stack_trace_t & trace, const bool lines)
     {
-        auto [fd_stdout, fd_stderr, exit_status]
-            = exec_command("/usr/bin/addr2line", "", "--demangle", "-f", "-p", "-a", "-e",
-                executable_path, address);
+        std::vector < frame_info_t > frames(trace.count);
+        std::vector < bool > cached(trace.count, false);
+        {
+            std::shared_lock lock(cache_mutex);
+            for (int i = 0; i < trace.count; i++)
+            {
+                if (const auto it = frame_cache.find(trace.frames[i]); it != frame_cache.end()) {
+                    frames[i] = it->second;
+                    cached[i] = true;
+                }
+            }
+        }
 
-        if (exit_status != 0)
+        std::vector < frame_info_t * > missing_lines;
+        bool updated = false;
+        for (int i = 0; i < trace.count; i++)
         {
-            return {};
+            if (!cached[i]) {
+                frames[i] = resolve_symbol(trace.frames[i]);
+                updated = true;
+            }
+
+            if (lines && !frames[i].lines_resolved) {
+                missing_lines.push_back(&frames[i]);
+            }
         }
 
-        std::string caller, path;
-        if (const size_t pos = fd_stdout.find('/'); pos != std::string::npos) {
-            caller = fd_stdout.substr(0, pos - 4);
-            path = fd_stdout.substr(pos);
+        if (!missing_lines.empty()) {
+            resolve_lines(missing_lines);
+            updated = true;
         }
 
-        if (trim_symbol_yes())
+        if (updated)
         {
-            if (const size_t pos2 = caller.find('('); pos2 != std::string::npos) {
-                caller = caller.substr(0, pos2);
+            std::unique_lock lock(cache_mutex);
+            for (int i = 0; i < trace.count; i++) {
+                frame_cache.insert_or_assign(trace.frames[i], frames[i]);
             }
         }
 
-        if (!caller.empty() && !path.empty()) {
-            return {.name = caller, .file = replace_all(path, "\n", "") };
-        }
+        return frames;
+    }
 
-        return {.name = replace_all(fd_stdout, "\n", ""), .file = ""};
-    };
+    // drop everything from the first open to the last close, like the greedy regexes this replaced
+    void erase_span(std::string & name, const std::string & open, const std::string & close)
+    {
+        const size_t begin = name.find(open);
+        const size_t end = name.rfind(close);
+        if (begin != std::string::npos && end != std::string::npos && end >= begin) {
+            name.erase(begin, end + close.size() - begin);
+        }
+    }
 
-    for (const auto & [symbol, frame] : frames)
+    // fast backtrace
+    std::string backtrace_level_1(const std::vector < frame_info_t > & frames)
     {
-        if (std::regex_search(symbol, matches, pattern) && matches.size() > 3)
+        std::stringstream ss;
+        const bool trim = trim_symbol_yes();
+        int i = 0;
+        for (const auto & frame : frames)
         {
-            const std::string& executable_path = matches[1].str();
-            const std::string& traced_address = matches[2].str();
-            const std::string& traced_runtime_address = matches[3].str();
-            traced_info info;
-            if (traced_address.empty()) {
-                info = generate_addr2line_trace_info(executable_path, traced_runtime_address);
-            } else {
-
-                info = generate_addr2line_trace_info(executable_path, traced_address);
+            std::string name = frame.name;
+            if (trim)
+            {
+                erase_span(name, "(", ")");
+                erase_span(name, "[abi:", "]");
+                erase_span(name, "std::", "::");
             }
 
             ss  << color::color(0,4,1) << "Frame " << color::color(5,2,1) << "#" << i++ << " "
-                << std::hex << color::color(2,4,5) << frame
-                << ": " << color::color(1,5,5) << info.name << color::no_color() << "\n";
-            if (!info.file.empty())
-                ss << "          " << color::color(0,1,5) << info.file << color::no_color() << "\n";
-        } else {
-            ss << "No trace information for " << std::hex << frame << "\n";
+                << color::color(2,4,5) << frame.module
+                << ": " << color::color(1,5,5) << name << color::no_color() << "\n";
         }
+
+        return ss.str();
     }
 
-    return ss.str();
+    // slow backtrace, with better trace info
+    std::string backtrace_level_2(const debug::stack_trace_t & trace, const std::vector < frame_info_t > & frames)
+    {
+        std::stringstream ss;
+        const bool trim = trim_symbol_yes();
+        for (int i = 0; i < trace.count; i++)
+        {
+            const auto & frame = frames[i];
+            std::string name = frame.function.empty() ? frame.name : frame.function;
+            if (trim) {
+                if (const size_t pos = name.find('('); pos != std::string::npos) {
+                    name = name.substr(0, pos);
+                }
+            }
+
+            ss  << color::color(0,4,1) << "Frame " << color::color(5,2,1) << "#" << i << " "
+                << std::hex << color::color(2,4,5) << trace.frames[i] << std::dec
+                << ": " << color::color(1,5,5) << name << color::no_color() << "\n";
+            if (!frame.file.empty())
+                ss << "          " << color::color(0,1,5) << frame.file << color::no_color() << "\n";
+        }
+
+        return ss.str();
+    }
 }
 
 std::atomic_int debug::g_pre_defined_level = -1;
 
-std::string debug::backtrace()
+debug::stack_trace_t debug::capture_backtrace()
+{
+    stack_trace_t trace;
+    trace.level = get_env(BACKTRACE_LEVEL).empty() ? g_pre_defined_level.load() : get_variable<int>(BACKTRACE_LEVEL);
+    if (trace.level != 1 && trace.level != 2) {
+        return trace;
+    }
+
+    void * frames[max_stack_frames + 1];
+    const int count = ::backtrace(frames, max_stack_frames + 1);
+    // leave out this function
+    for (int i = 1; i < count; i++) {
+        trace.frames[trace.count++] = frames[i];
+    }
+
+    return trace;
+}
+
+std::string debug::format_backtrace(const stack_trace_t & trace)
 {
-    switch (/* const auto level = */get_env(BACKTRACE_LEVEL).empty() ? g_pre_defined_level.load()
-        : get_variable<int>(BACKTRACE_LEVEL))
+    switch (trace.level)
     {
-        case 1: return backtrace_level_1();
-        case 2: return backtrace_level_2();
+        case 1: return backtrace_level_1(symbolize(trace, false));
+        case 2: return backtrace_level_2(trace, symbolize(trace, true));
         default: return "";
     }
 }
+
+std::string debug::backtrace()
+{
+    return format_backtrace(capture_backtrace());
+}
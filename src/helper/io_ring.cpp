@@ -0,0 +1,326 @@
+/* io_ring.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <pthread.h>
+#include "helper/io_ring.h"
+#include "helper/cpp_assert.h"
+#include "helper/log.h"
+
+#if USE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+#endif
+
+struct io_ring_t::batch_t
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t remaining = 0;
+};
+
+void io_ring_t::fallback(request_t & request)
+{
+    ssize_t ret;
+    if (request.opcode == IO_READ) {
+        ret = pread(request.fd, request.buffer, request.length, static_cast<off_t>(request.offset));
+    } else {
+        ret = pwritev(request.fd, request.iov, static_cast<int>(request.iovcnt), static_cast<off_t>(request.offset));
+    }
+
+    request.result = ret == -1 ? -errno : ret;
+}
+
+#if USE_IO_URING
+
+static int io_uring_setup(const unsigned entries, io_uring_params * params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+// the kernel reads and writes the ring indexes concurrently with us
+static unsigned load_acquire(unsigned * p) { return std::atomic_ref(*p).load(std::memory_order_acquire); }
+static void store_release(unsigned * p, const unsigned v) { std::atomic_ref(*p).store(v, std::memory_order_release); }
+
+bool io_ring_t::open(const unsigned entries)
+{
+    close();
+
+    io_uring_params params{};
+    const int fd = io_uring_setup(entries, &params);
+    if (fd == -1)
+    {
+        verbose_log("io_uring unavailable (", strerror(errno), "), using blocking I/O");
+        return false;
+    }
+
+    ring_fd_ = fd;
+    entries_ = params.sq_entries;
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring_ = single_mmap ? sq_ring_
+        : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED)
+    {
+        warning_log("Cannot map io_uring (", strerror(errno), "), using blocking I/O");
+        unmap();
+        ::close(ring_fd_);
+        ring_fd_ = -1;
+        return false;
+    }
+
+    const auto sq = static_cast<char *>(sq_ring_);
+    const auto cq = static_cast<char *>(cq_ring_);
+    sq_head_  = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail_  = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_  = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head_  = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_  = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_  = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_     = cq + params.cq_off.cqes;
+
+    reaper_ = std::thread([this] {
+        pthread_setname_np(pthread_self(), "IORing");
+        reap();
+    });
+
+    verbose_log("io_uring ready with queue depth ", entries_);
+    return true;
+}
+
+void io_ring_t::unmap()
+{
+    if (sqes_ && sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ && sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    sq_ring_ = cq_ring_ = sqes_ = nullptr;
+}
+
+void io_ring_t::close()
+{
+    if (ring_fd_ == -1) {
+        return;
+    }
+
+    // a NOP with no request attached tells the reaper to leave
+    {
+        std::lock_guard lock(sq_mutex_);
+        push(request_t { }, 0);
+        while (io_uring_enter(ring_fd_, 1, 0, 0) == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            std::this_thread::yield();
+        }
+    }
+
+    reaper_.join();
+    unmap();
+    ::close(ring_fd_);
+    ring_fd_ = -1;
+    entries_ = 0;
+}
+
+void io_ring_t::push(const request_t & request, const uint64_t user_data)
+{
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & *sq_mask_;
+    auto & sqe = static_cast<io_uring_sqe *>(sqes_)[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = user_data;
+    if (user_data == 0) {
+        sqe.opcode = IORING_OP_NOP;
+    } else if (request.opcode == IO_READ) {
+        sqe.opcode = IORING_OP_READV;   // readv rather than read, it is available since the first io_uring kernels
+        sqe.fd = request.fd;
+        sqe.off = request.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(&request.read_iov);
+        sqe.len = 1;
+    } else {
+        sqe.opcode = IORING_OP_WRITEV;
+        sqe.fd = request.fd;
+        sqe.off = request.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(request.iov);
+        sqe.len = request.iovcnt;
+    }
+
+    sq_array_[index] = index;
+    store_release(sq_tail_, tail + 1);
+}
+
+void io_ring_t::reap()
+{
+    const unsigned cq_size = *cq_mask_ + 1;
+    for (bool stopping = false; !stopping;)
+    {
+        if (io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+        {
+            error_log("io_uring_enter failed: ", strerror(errno));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        unsigned head = *cq_head_;
+        const unsigned tail = load_acquire(cq_tail_);
+        unsigned reaped = 0;
+        for (; head != tail; head++)
+        {
+            const auto & cqe = static_cast<io_uring_cqe *>(cqes_)[head & *cq_mask_];
+            if (cqe.user_data == 0) {
+                stopping = true;
+                continue;
+            }
+
+            auto * request = reinterpret_cast<request_t *>(cqe.user_data);
+            request->result = cqe.res;
+            batch_t * batch = request->batch;   // request may be gone once the batch is released
+            reaped++;
+
+            std::lock_guard lock(batch->mutex);
+            if (--batch->remaining == 0) {
+                batch->cv.notify_all();
+            }
+        }
+
+        store_release(cq_head_, head);
+        if (reaped)
+        {
+            std::lock_guard lock(slots_mutex_);
+            inflight_ -= reaped;
+            assert_short(inflight_ <= cq_size);
+            slots_cv_.notify_all();
+        }
+    }
+}
+
+void io_ring_t::submit(request_t * requests, const size_t count)
+{
+    if (!available())
+    {
+        for (size_t i = 0; i < count; i++) {
+            fallback(requests[i]);
+        }
+
+        return;
+    }
+
+    batch_t batch;
+    batch.remaining = count;
+    const unsigned cq_size = *cq_mask_ + 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        requests[i].batch = &batch;
+        requests[i].read_iov = { .iov_base = requests[i].buffer, .iov_len = requests[i].length };
+    }
+
+    std::string error;
+    for (size_t done = 0; done < count && error.empty();)
+    {
+        // never queue more than the SQ holds, nor more than the CQ can report
+        auto chunk = static_cast<unsigned>(std::min<size_t>(count - done, entries_));
+        {
+            std::unique_lock lock(slots_mutex_);
+            slots_cv_.wait(lock, [&] { return inflight_ < cq_size; });
+            chunk = std::min(chunk, cq_size - inflight_);
+            inflight_ += chunk;
+        }
+
+        std::lock_guard lock(sq_mutex_);
+        for (unsigned i = 0; i < chunk; i++) {
+            push(requests[done + i], reinterpret_cast<uint64_t>(&requests[done + i]));
+        }
+
+        unsigned submitted = 0;
+        while (submitted < chunk)
+        {
+            const int ret = io_uring_enter(ring_fd_, chunk - submitted, 0, 0);
+            if (ret != -1) {
+                submitted += static_cast<unsigned>(ret);
+            } else if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                std::this_thread::yield();
+            } else {
+                error = std::string("io_uring_enter failed: ") + strerror(errno);
+                break;
+            }
+        }
+
+        if (submitted < chunk)
+        {
+            // take back the entries the kernel never saw, the next submitter would send them along
+            store_release(sq_tail_, *sq_tail_ - (chunk - submitted));
+            {
+                std::lock_guard slots_lock(slots_mutex_);
+                inflight_ -= chunk - submitted;
+                slots_cv_.notify_all();
+            }
+
+            std::lock_guard batch_lock(batch.mutex);
+            batch.remaining -= count - done - submitted;
+        }
+
+        done += chunk;
+    }
+
+    // submitted requests point into this frame, they have to land before an error unwinds it
+    {
+        std::unique_lock lock(batch.mutex);
+        batch.cv.wait(lock, [&] { return batch.remaining == 0; });
+    }
+
+    assert_throw(error.empty(), error);
+}
+
+#else
+
+bool io_ring_t::open(unsigned)
+{
+    verbose_log("Built without io_uring, using blocking I/O");
+    return false;
+}
+
+void io_ring_t::close() { }
+void io_ring_t::push(const request_t &, uint64_t) { }
+void io_ring_t::reap() { }
+void io_ring_t::unmap() { }
+
+void io_ring_t::submit(request_t * requests, const size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        fallback(requests[i]);
+    }
+}
+
+#endif
@@ -1,15 +1,518 @@
 #include "helper/log.h"
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <climits>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-std::mutex debug::log_mutex;
-std::atomic_bool debug::verbose = false;
-int debug::caller_max_size = 0;
-bool debug::do_i_show_caller_next_time = true;
-std::string debug::_strip_name_(const std::string & name)
+constexpr debug::log_level_t default_log_level = DEBUG ? debug::LOG_DEBUG : debug::LOG_WARNING;
+std::atomic < debug::log_level_t > debug::log_level = default_log_level;
+
+void debug::set_verbose(const bool enabled)
 {
-    const std::regex pattern(R"([\w]+ (.*)\(.*\))");
-    if (std::smatch matches; std::regex_match(name, matches, pattern) && matches.size() > 1) {
-        return matches[1];
+    log_level = enabled ? std::min(default_log_level, LOG_VERBOSE) : default_log_level;
+}
+
+namespace {
+    constexpr size_t ring_capacity = 64 * 1024;            // per thread
+    constexpr size_t max_record_text = ring_capacity / 4;   // longer records are truncated
+    constexpr timespec batch_interval { .tv_sec = 0, .tv_nsec = 1000 * 1000 };
+
+    struct record_header_t
+    {
+        uint64_t timestamp;         // steady clock, orders records of different threads in a batch
+        const char * caller;        // static, from caller_name()
+        uint32_t text_length;
+        uint16_t caller_length;
+        debug::log_level_t level;
+        int32_t saved_errno;
+    };
+
+    /// single producer (the owning thread), single consumer (the writer)
+    struct ring_t
+    {
+        alignas(64) std::atomic<uint64_t> tail { 0 };       // written by the producer
+        std::atomic<uint64_t> dropped { 0 };
+        alignas(64) std::atomic<uint64_t> head { 0 };       // written by the writer
+        std::atomic<uint64_t> written { 0 };                // head once its batch reached stderr
+        uint64_t reported_dropped = 0;                      // writer only
+        std::atomic_bool retired { false };                 // owning thread exited
+        char data[ring_capacity] { };
+
+        void copy_in(const uint64_t position, const void * src, const size_t length)
+        {
+            const size_t offset = position % ring_capacity;
+            const size_t first = std::min(length, ring_capacity - offset);
+            std::memcpy(data + offset, src, first);
+            std::memcpy(data, static_cast<const char *>(src) + first, length - first);
+        }
+
+        void copy_out(const uint64_t position, void * dst, const size_t length) const
+        {
+            const size_t offset = position % ring_capacity;
+            const size_t first = std::min(length, ring_capacity - offset);
+            std::memcpy(dst, data + offset, first);
+            std::memcpy(static_cast<char *>(dst) + first, data, length - first);
+        }
+
+        enum push_result_t { PUSHED, PUSHED_PAST_HALF, DROPPED };
+
+        /// a full ring drops the record and counts it, PUSHED_PAST_HALF asks the writer to come early
+        push_result_t push(const record_header_t & header, const char * text)
+        {
+            const size_t size = sizeof(header) + header.text_length;
+            const uint64_t position = tail.load(std::memory_order_relaxed);
+            const uint64_t used = position - head.load(std::memory_order_acquire);
+            if (ring_capacity - used < size)
+            {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return DROPPED;
+            }
+
+            copy_in(position, &header, sizeof(header));
+            copy_in(position + sizeof(header), text, header.text_length);
+            tail.store(position + size, std::memory_order_release);
+            return used < ring_capacity / 2 && used + size >= ring_capacity / 2 ? PUSHED_PAST_HALF : PUSHED;
+        }
+    };
+
+    /// std::string backed streambuf, keeps its capacity between records so rendering stops allocating
+    class record_buffer_t final : public std::streambuf
+    {
+    public:
+        std::string text;
+
+    protected:
+        int_type overflow(const int_type ch) override
+        {
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                text.push_back(traits_type::to_char_type(ch));
+            }
+
+            return traits_type::not_eof(ch);
+        }
+
+        std::streamsize xsputn(const char * s, const std::streamsize count) override
+        {
+            text.append(s, static_cast<size_t>(count));
+            return count;
+        }
+    };
+
+    struct thread_record_t
+    {
+        record_buffer_t buffer;
+        std::ostream stream { &buffer };
+        std::ios_base::fmtflags default_flags = stream.flags();
+        std::shared_ptr < ring_t > ring;
+
+        void reset()
+        {
+            buffer.text.clear();
+            stream.flags(default_flags);
+            stream.fill(' ');
+            stream.width(0);
+            stream.precision(6);
+            stream.clear();
+        }
+    };
+
+    // a plain pointer, so logging still works from destructors that run after the thread's own
+    // thread_local objects are gone (static destructors on the main thread)
+    thread_local thread_record_t * thread_record = nullptr;
+    thread_local bool thread_record_released = false;
+
+    struct thread_record_owner_t
+    {
+        ~thread_record_owner_t()
+        {
+            if (thread_record->ring) {
+                thread_record->ring->retired.store(true, std::memory_order_release);
+            }
+
+            delete thread_record;
+            thread_record = nullptr;
+            thread_record_released = true;
+        }
+    };
+
+    thread_record_t & current_record()
+    {
+        if (!thread_record)
+        {
+            thread_record = new thread_record_t;
+            if (!thread_record_released) {
+                thread_local thread_record_owner_t owner;
+            }
+        }
+
+        return *thread_record;
+    }
+
+    void write_all(const std::string & output)
+    {
+        for (size_t written = 0; written < output.size();)
+        {
+            const ssize_t ret = ::write(STDERR_FILENO, output.data() + written, output.size() - written);
+            if (ret == -1)
+            {
+                if (errno == EINTR) continue;
+                return;
+            }
+
+            written += static_cast<size_t>(ret);
+        }
+    }
+
+    class log_writer_t
+    {
+        struct pending_t
+        {
+            record_header_t header;
+            size_t offset;          // of the text in arena
+        };
+
+        std::mutex rings_mutex_;    // ring registration and the writer, never a log call after its first
+        std::vector < std::shared_ptr < ring_t > > rings_;
+
+        uint32_t wake_ = 0;         // futex word, bumped to cut a writer wait short
+        std::atomic_bool idle_ { false };
+        std::atomic_bool running_ { true };
+        std::atomic_bool stopped_ { false };
+        std::atomic < int > caller_max_size_ { 0 };
+        std::atomic < uint64_t > removed_dropped_ { 0 };    // drops of rings whose thread has exited
+        const pid_t pid_ = getpid();
+
+        // writer only, reused across batches
+        std::vector < std::shared_ptr < ring_t > > snapshot_;
+        std::vector < pending_t > pending_;
+        std::string arena_;
+        std::string output_;
+
+        std::thread writer_;        // last, it starts running in the constructor
+
+        void format(const record_header_t & header, const char * text, std::string & output)
+        {
+            if (header.level != debug::LOG_PLAIN)
+            {
+                // alignment only ever grows, so columns stay put once every caller has been seen
+                const int caller_size = header.caller_length;
+                int max_size = caller_max_size_.load(std::memory_order_relaxed);
+                while (max_size < caller_size
+                    && !caller_max_size_.compare_exchange_weak(max_size, caller_size, std::memory_order_relaxed)) { }
+                max_size = std::max(max_size, caller_size);
+
+                output += color::color(0, 2, 2);
+                output += '[';
+                output.append(header.caller, header.caller_length);
+                output += ']';
+                output.append(std::max(max_size + 1 - caller_size, 1), ' ');
+                output += color::no_color();
+            }
+
+            const std::string_view message(text, header.text_length);
+            switch (header.level)
+            {
+                case debug::LOG_PLAIN:
+                case debug::LOG_CONSOLE:
+                    output += message;
+                    break;
+                case debug::LOG_DEBUG:
+                    output += color::color(2, 2, 2) + "[DEBUG]:   " + color::color(4, 4, 4);
+                    output += message;
+                    output += color::no_color();
+                    break;
+                case debug::LOG_VERBOSE:
+                    output += color::color(2, 2, 2) + "[VERBOSE]: " + color::no_color();
+                    output += message;
+                    break;
+                case debug::LOG_WARNING:
+                    output += color::color(4, 4, 0) + "[WARNING]: " + color::color(5, 5, 0);
+                    output += message;
+                    output += color::no_color();
+                    break;
+                case debug::LOG_ERROR:
+                    output += color::color(4, 0, 0) + "[ERROR]:   " + color::color(5, 0, 0);
+                    output += message;
+                    output += header.saved_errno != 0 ? color::color(5, 0, 0) : color::color(0, 4, 0);
+                {
+                    char buffer[128];
+                    output += "errno=" + std::to_string(header.saved_errno)
+                        + " (" + strerror_r(header.saved_errno, buffer, sizeof(buffer)) + ")";
+                }
+                    output += color::no_color();
+                    break;
+            }
+
+            output += '\n';
+        }
+
+        /// move everything currently in the rings to stderr, returns false if there was nothing
+        bool drain()
+        {
+            {
+                std::lock_guard lock(rings_mutex_);
+                snapshot_ = rings_;
+                std::erase_if(rings_, [this](const std::shared_ptr < ring_t > & ring)
+                {
+                    if (!ring->retired.load(std::memory_order_acquire)
+                        || ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_acquire)
+                        || ring->dropped.load(std::memory_order_relaxed) != ring->reported_dropped)
+                    {
+                        return false;
+                    }
+
+                    removed_dropped_.fetch_add(ring->reported_dropped, std::memory_order_relaxed);
+                    return true;
+                });
+            }
+
+            pending_.clear();
+            arena_.clear();
+            uint64_t dropped = 0;
+            for (const auto & ring : snapshot_)
+            {
+                const uint64_t tail = ring->tail.load(std::memory_order_acquire);
+                uint64_t head = ring->head.load(std::memory_order_relaxed);
+                while (head != tail)
+                {
+                    pending_t record { };
+                    ring->copy_out(head, &record.header, sizeof(record.header));
+                    head += sizeof(record.header);
+
+                    const size_t length = record.header.text_length;
+                    record.offset = arena_.size();
+                    arena_.resize(arena_.size() + length);
+                    ring->copy_out(head, arena_.data() + record.offset, length);
+                    head += length;
+                    pending_.push_back(record);
+                }
+
+                ring->head.store(head, std::memory_order_release);
+
+                const uint64_t total = ring->dropped.load(std::memory_order_relaxed);
+                dropped += total - ring->reported_dropped;
+                ring->reported_dropped = total;
+            }
+
+            if (pending_.empty() && dropped == 0)
+            {
+                snapshot_.clear();
+                return false;
+            }
+
+            std::ranges::stable_sort(pending_, {}, [](const pending_t & record) { return record.header.timestamp; });
+            output_.clear();
+            for (const auto & [header, offset] : pending_) {
+                format(header, arena_.data() + offset, output_);
+            }
+
+            if (dropped != 0)
+            {
+                const std::string text = std::to_string(dropped) + " log records dropped, logging faster than stderr drains";
+                const record_header_t header { .timestamp = 0, .caller = "Logger",
+                    .text_length = static_cast<uint32_t>(text.size()), .caller_length = 6,
+                    .level = debug::LOG_WARNING, .saved_errno = 0 };
+                format(header, text.c_str(), output_);
+            }
+
+            write_all(output_);
+            for (const auto & ring : snapshot_) {
+                ring->written.store(ring->head.load(std::memory_order_relaxed), std::memory_order_release);
+            }
+
+            snapshot_.clear();
+            return true;
+        }
+
+        [[nodiscard]] bool has_pending()
+        {
+            std::lock_guard lock(rings_mutex_);
+            return std::ranges::any_of(rings_, [](const std::shared_ptr < ring_t > & ring) {
+                return ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_acquire)
+                    || ring->dropped.load(std::memory_order_relaxed) != ring->reported_dropped;
+            });
+        }
+
+        void wait(const timespec * timeout)
+        {
+            const uint32_t seen = std::atomic_ref(wake_).load(std::memory_order_acquire);
+            if (running_.load(std::memory_order_acquire)) {
+                syscall(SYS_futex, &wake_, FUTEX_WAIT_PRIVATE, seen, timeout, nullptr, 0);
+            }
+        }
+
+        void run()
+        {
+            pthread_setname_np(pthread_self(), "Logger");
+            for (;;)
+            {
+                const bool drained = drain();
+                if (!running_.load(std::memory_order_acquire))
+                {
+                    drain();
+                    return;
+                }
+
+                if (!drained)
+                {
+                    // producers check idle_ after publishing a record, one of the two sides sees the other
+                    idle_.store(true, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (!has_pending()) {
+                        wait(nullptr);
+                    }
+
+                    idle_.store(false, std::memory_order_relaxed);
+                }
+
+                // let a batch build up, so a busy logger costs one wakeup per interval instead of one
+                // per record. a ring passing half full, a flush or stop cuts this short
+                wait(&batch_interval);
+            }
+        }
+
+        void wake()
+        {
+            std::atomic_ref(wake_).fetch_add(1, std::memory_order_release);
+            syscall(SYS_futex, &wake_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+
+    public:
+        log_writer_t() : writer_([this] { run(); }) { }
+
+        ring_t & register_thread()
+        {
+            auto ring = std::make_shared < ring_t > ();
+            {
+                std::lock_guard lock(rings_mutex_);
+                rings_.push_back(ring);
+            }
+
+            current_record().ring = ring;
+            return *ring;
+        }
+
+        void commit(const debug::log_level_t level, const std::string_view caller, const int saved_errno)
+        {
+            thread_record_t & record = current_record();
+            auto & text = record.buffer.text;
+            if (text.size() > max_record_text)
+            {
+                text.resize(max_record_text);
+                text += " [truncated]";
+            }
+
+            const record_header_t header {
+                .timestamp = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()),
+                .caller = caller.data(),
+                .text_length = static_cast<uint32_t>(text.size()),
+                .caller_length = static_cast<uint16_t>(std::min < size_t > (caller.size(), UINT16_MAX)),
+                .level = level,
+                .saved_errno = saved_errno,
+            };
+
+            if (stopped_.load(std::memory_order_acquire))
+            {
+                // after shutdown, e.g. from static destructors, write directly
+                std::string output;
+                format(header, text.c_str(), output);
+                write_all(output);
+                return;
+            }
+
+            ring_t & ring = record.ring ? *record.ring : register_thread();
+            const auto result = ring.push(header, text.c_str());
+            if (result == ring_t::DROPPED) {
+                return;
+            }
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (result == ring_t::PUSHED_PAST_HALF || idle_.load(std::memory_order_relaxed)) {
+                wake();
+            }
+        }
+
+        void flush()
+        {
+            if (stopped_.load(std::memory_order_acquire)) {
+                return;
+            }
+
+            std::vector < std::pair < std::shared_ptr < ring_t >, uint64_t > > targets;
+            {
+                std::lock_guard lock(rings_mutex_);
+                for (const auto & ring : rings_) {
+                    targets.emplace_back(ring, ring->tail.load(std::memory_order_acquire));
+                }
+            }
+
+            wake();
+            for (const auto & [ring, tail] : targets)
+            {
+                while (ring->written.load(std::memory_order_acquire) < tail) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+        }
+
+        void stop()
+        {
+            // a forked child has a copy of this object but no writer thread
+            if (getpid() != pid_ || stopped_.exchange(true)) {
+                return;
+            }
+
+            running_.store(false, std::memory_order_release);
+            wake();
+            writer_.join();
+        }
+
+        [[nodiscard]] uint64_t dropped()
+        {
+            std::lock_guard lock(rings_mutex_);
+            uint64_t total = removed_dropped_.load(std::memory_order_relaxed);
+            for (const auto & ring : rings_) {
+                total += ring->dropped.load(std::memory_order_relaxed);
+            }
+
+            return total;
+        }
+    };
+
+    // never destroyed, so static destructors can still log, the writer is drained and stopped at exit
+    log_writer_t & log_writer()
+    {
+        static log_writer_t * writer = [] {
+            auto * instance = new log_writer_t;
+            std::atexit([] { log_writer().stop(); });
+            return instance;
+        }();
+
+        return *writer;
     }
+}
 
-    return name;
+std::ostream & debug::_record_stream_()
+{
+    return current_record().stream;
+}
+
+void debug::_commit_record_(const log_level_t level, const std::string_view caller, const int saved_errno)
+{
+    log_writer().commit(level, caller, saved_errno);
+    current_record().reset();
+}
+
+void debug::flush_log()
+{
+    log_writer().flush();
+}
+
+uint64_t debug::dropped_log_records()
+{
+    return log_writer().dropped();
 }
@@ -0,0 +1,56 @@
+/* base64.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef CORE_BASE64_H
+#define CORE_BASE64_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/* Standard padded base64, the encoding of every block on the JSON /stream protocol.
+ * encode() and decode() run the widest kernel the CPU supports, chosen once with cpuid:
+ * AVX2 (24 bytes per step), SSSE3 (12 bytes per step), or the table driven scalar code of
+ * helper/base64.hpp, which also handles the tails. Output is identical to to_base64/from_base64,
+ * decode() throws the same runtime_error on malformed input. */
+namespace base64 {
+    enum kernel_t { SCALAR, SSSE3, AVX2 };
+
+    [[nodiscard]] constexpr size_t encoded_size(const size_t length) { return (length + 2) / 3 * 4; }
+
+    /// bytes text decodes to, throws runtime_error if its length or padding is malformed
+    [[nodiscard]] size_t decoded_size(std::string_view text);
+
+    /// write encoded_size(length) characters to text, no terminator
+    void encode(const void * data, size_t length, char * text);
+    [[nodiscard]] std::string encode(std::string_view data);
+
+    /// decode text straight into out, which holds capacity bytes. returns the decoded length,
+    /// throws runtime_error on malformed input or if it does not fit
+    size_t decode(std::string_view text, void * out, size_t capacity);
+
+    [[nodiscard]] kernel_t active_kernel();
+    [[nodiscard]] bool kernel_supported(kernel_t kernel);
+    /// encode() and decode() with a specific kernel, for tests and benchmarks
+    void encode_with(kernel_t kernel, const void * data, size_t length, char * text);
+    size_t decode_with(kernel_t kernel, std::string_view text, void * out, size_t capacity);
+} // base64
+
+#endif //CORE_BASE64_H
@@ -21,17 +21,43 @@
 #ifndef BIN2HEX_H
 #define BIN2HEX_H
 
+#include <cstddef>
 #include <vector>
 #include <string>
+#include <string_view>
 
+/* Lowercase hex codec.
+ * encode() and decode() work on caller buffers and run the widest kernel the CPU supports, chosen
+ * once with cpuid: AVX2 (32 bytes per step), SSSE3 (16 bytes per step), or a branch-free scalar
+ * loop that also handles the tails. decode() accepts either case. */
 namespace bin2hex {
+    enum kernel_t { SCALAR, SSSE3, AVX2 };
+
+    /// write 2 * length hex digits of bin to hex, no terminator
+    void encode(const void * bin, size_t length, char * hex);
+
+    /// read length hex digits (length is even) into length / 2 bytes, returns false on a non hex digit
+    [[nodiscard]] bool decode(const char * hex, size_t length, void * bin);
+
+    [[nodiscard]] kernel_t active_kernel();
+    [[nodiscard]] bool kernel_supported(kernel_t kernel);
+    /// encode() and decode() with a specific kernel, for tests and benchmarks
+    void encode_with(kernel_t kernel, const void * bin, size_t length, char * hex);
+    [[nodiscard]] bool decode_with(kernel_t kernel, const char * hex, size_t length, void * bin);
+
     void c_bin2hex(char bin, char hex[2]);
 
-    std::string bin2hex(const std::vector < char > &);
+    std::string bin2hex(std::string_view bin);
+    inline std::string bin2hex(const std::vector < char > & vec) {
+        return bin2hex::bin2hex(std::string_view(vec.data(), vec.size()));
+    }
+
     inline std::string bin2hex(const std::string & str) {
-        const std::vector < char > vec(str.begin(), str.end());
-        return bin2hex::bin2hex(vec);
+        return bin2hex::bin2hex(std::string_view(str));
     }
+
+    /// reverse of bin2hex, throws std::invalid_argument on malformed input
+    std::vector < char > hex2bin(std::string_view hex);
 } // bin2hex
 
 #endif //BIN2HEX_H
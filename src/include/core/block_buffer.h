@@ -0,0 +1,73 @@
+/* block_buffer.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef BLOCK_BUFFER_H
+#define BLOCK_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+#define BLOCK_SIZE (1024 * 64) /* 64KB blocks, also the largest content defined chunk */
+
+/* Refcounted handle to a pooled BLOCK_SIZE buffer.
+ * Copying a handle shares the buffer, the last handle returns it to the pool.
+ * Only write into a buffer while you hold the only handle to it. */
+class block_buffer_t {
+public:
+    struct storage_t
+    {
+        std::atomic < uint32_t > references;
+        uint32_t size;
+        storage_t * next;   // free list link while pooled
+        alignas(64) char data[BLOCK_SIZE];
+    };
+
+private:
+    storage_t * storage_ = nullptr;
+
+    explicit block_buffer_t(storage_t * storage) : storage_(storage) { }
+    void release();
+
+public:
+    block_buffer_t() = default;
+    block_buffer_t(const block_buffer_t & other) : storage_(other.storage_)
+    {
+        if (storage_) storage_->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    block_buffer_t(block_buffer_t && other) noexcept : storage_(other.storage_) { other.storage_ = nullptr; }
+    block_buffer_t & operator=(const block_buffer_t & other);
+    block_buffer_t & operator=(block_buffer_t && other) noexcept;
+    ~block_buffer_t() { release(); }
+
+    /// take a buffer from the pool, content is uninitialized
+    static block_buffer_t allocate(uint32_t size = BLOCK_SIZE);
+
+    [[nodiscard]] char * data() { return storage_->data; }
+    [[nodiscard]] const char * data() const { return storage_->data; }
+    [[nodiscard]] uint32_t size() const { return storage_ ? storage_->size : 0; }
+    void resize(uint32_t size);
+    [[nodiscard]] std::string_view view() const { return { data(), size() }; }
+    [[nodiscard]] bool unique() const { return storage_ && storage_->references.load(std::memory_order_acquire) == 1; }
+    [[nodiscard]] explicit operator bool() const { return storage_ != nullptr; }
+};
+
+#endif //BLOCK_BUFFER_H
@@ -0,0 +1,67 @@
+/* block_key.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef BLOCK_KEY_H
+#define BLOCK_KEY_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+enum block_hash_t : uint8_t
+{
+    BLOCK_HASH_CRC64     = 0,   // the original block hash, every dictionary written before XXH3 uses it
+    BLOCK_HASH_XXH3_128  = 1,
+};
+
+/* Block identity, the 128-bit content hash of a block.
+ * CRC64 keys only use lo (hi == 0) and keep their 16 digit names, which are the hex dump of the
+ * in-memory CRC value. XXH3-128 keys are named by the 32 digit canonical (big-endian) form, the
+ * same string xxh128sum prints for the block. */
+struct block_key_t
+{
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+
+    bool operator==(const block_key_t &) const = default;
+};
+
+static_assert(sizeof(block_key_t) == 16, "block_key_t is written to disk and to the wire as is");
+
+/// longest block name, in hex digits
+constexpr size_t BLOCK_NAME_MAX = sizeof(block_key_t) * 2;
+
+/* Names are only made at the filesystem and JSON edges, everything else passes block_key_t around */
+
+/// write the name of key into name, returns its length (16 or 32), no terminator
+size_t block_key_to_name(const block_key_t & key, char (&name)[BLOCK_NAME_MAX]);
+[[nodiscard]] std::string block_key_to_name(const block_key_t & key);
+
+/// parse a 16 or 32 digit block name, returns false if it is not one
+[[nodiscard]] bool block_name_to_key(std::string_view name, block_key_t & key);
+
+/// hash a block with the given algorithm
+[[nodiscard]] block_key_t block_key_of(const char * data, size_t length, block_hash_t algorithm);
+
+/// "crc64" or "xxh3_128", throws runtime_error on anything else
+[[nodiscard]] block_hash_t block_hash_from_name(const std::string & name);
+[[nodiscard]] const char * block_hash_name(block_hash_t algorithm);
+
+#endif //BLOCK_KEY_H
@@ -1,4 +1,142 @@
+/* cache.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "core/block_buffer.h"
+#include "core/block_key.h"
+
+/* Decompressed blocks kept in memory, keyed by the block hash.
+ * Blocks are content addressed, so an entry never goes stale, it only has to leave when a block is
+ * deleted. A hit hands out another reference to the cached buffer, nothing is copied.
+ *
+ * Every shard runs W-TinyLFU: new blocks enter a small LRU window, and a block leaving the window
+ * only displaces the coldest block of the main region (segmented LRU, probation and protected) if
+ * a count-min sketch of recent accesses says it is used more often. A scan of blocks read once
+ * passes through the window without pushing the working set out. */
+extern
+class block_cache_t {
+public:
+    struct stats_t
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t admitted = 0;      // moved from the window into the main region
+        uint64_t rejected = 0;      // lost against the main region's victim and dropped
+        uint64_t evicted = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+private:
+    // fewer shards than the block index, every shard needs room for a useful number of 64KB blocks
+    static constexpr unsigned shard_bits = 4;
+
+    enum segment_t : uint8_t { WINDOW, PROBATION, PROTECTED };
+
+    struct entry_t
+    {
+        block_key_t key;
+        block_buffer_t block;
+        segment_t segment;
+    };
+
+    using list_t = std::list < entry_t >;   // front is the most recently used
+
+    struct key_hash_t
+    {
+        size_t operator()(const block_key_t & key) const { return mix(key); }
+    };
+
+    /// count-min sketch, 4 rows of counters saturating at 15, halved every sample so popularity fades
+    class frequency_sketch_t {
+        std::vector < uint8_t > table_;
+        size_t mask_ = 0;
+        size_t additions_ = 0;
+        size_t sample_size_ = 0;
+
+    public:
+        void resize(size_t entries);
+        void increment(uint64_t hash);
+        [[nodiscard]] unsigned frequency(uint64_t hash) const;
+    };
+
+    struct alignas(64) shard_t
+    {
+        std::mutex mutex;
+        std::unordered_map < block_key_t, list_t::iterator, key_hash_t > entries;
+        list_t window;
+        list_t probation;
+        list_t protected_;
+        uint64_t window_bytes = 0;
+        uint64_t probation_bytes = 0;
+        uint64_t protected_bytes = 0;
+        uint64_t capacity = 0;
+        frequency_sketch_t sketch;
+        stats_t stats;
+    };
+
+    std::array < shard_t, 1 << shard_bits > shards_;
+    std::atomic < uint64_t > capacity_ { 0 };
+
+    static uint64_t mix(const block_key_t & key);
+    /// a cached block pins its whole pooled buffer, however short the chunk in it is
+    static constexpr uint64_t footprint = sizeof(block_buffer_t::storage_t);
+    static constexpr uint64_t charge(const block_buffer_t &) { return footprint; }
+    shard_t & shard_of(uint64_t hash) { return shards_[hash >> (64 - shard_bits)]; }
+
+    static list_t & list_of(shard_t & shard, segment_t segment);
+    static uint64_t & bytes_of(shard_t & shard, segment_t segment);
+    static void move(shard_t & shard, list_t::iterator entry, segment_t to);
+    static void remove(shard_t & shard, list_t::iterator entry);
+    static void enforce_capacity(shard_t & shard);
+
+public:
+    block_cache_t() = default;
+    block_cache_t(const block_cache_t &) = delete;
+    block_cache_t & operator=(const block_cache_t &) = delete;
+
+    /// memory budget in bytes, shrinking evicts right away, 0 turns the cache off and empties it.
+    /// Below min_capacity() blocks no longer make it past the window, that is warned about
+    void resize(uint64_t capacity);
+    [[nodiscard]] uint64_t capacity() const { return capacity_.load(std::memory_order_relaxed); }
+    /// room for the window and one block of the main region in every shard
+    [[nodiscard]] uint64_t min_capacity() const { return shards_.size() * 2 * footprint; }
+    [[nodiscard]] bool enabled() const { return capacity() != 0; }
+
+    /// on a hit block shares the cached buffer, which must not be written to
+    bool lookup(const block_key_t & key, block_buffer_t & block);
+    /// offer a block that was just read, the admission policy decides whether it stays
+    void insert(const block_key_t & key, const block_buffer_t & block);
+    void erase(const block_key_t & key);
+    void clear();
+
+    [[nodiscard]] stats_t stats();
+} g_block_cache;
+
 #endif //CACHE_H
@@ -0,0 +1,64 @@
+/* chunker.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <cstdint>
+#include <vector>
+#include "core/block_buffer.h"
+
+/* FastCDC content defined chunking.
+ * A gear hash rolls over the data and a chunk ends where the top bits of the hash are zero, so a
+ * boundary depends on the 64 bytes in front of it and not on its offset in the file. Inserting a
+ * byte near the start of a file only changes the chunk it lands in, every later chunk is cut at the
+ * same content as before and deduplicates against the earlier backup.
+ * Normalized chunking: a stricter mask before avg_size and a looser one after it keep chunk sizes
+ * close to the average. The scan rolls two bytes per step, the first through a gear table shifted
+ * left by one, which cuts at exactly the same places as a byte at a time. */
+class fastcdc_t {
+public:
+    struct params_t
+    {
+        uint32_t min_size = 16 * 1024;      // no cut point is looked for before this, the scan skips it
+        uint32_t avg_size = 32 * 1024;
+        uint32_t max_size = BLOCK_SIZE;     // a chunk has to fit in a block buffer
+    };
+
+private:
+    params_t params_;
+    uint64_t mask_small_;       // before avg_size, two bits more than log2(avg_size)
+    uint64_t mask_large_;       // after avg_size, two bits less
+
+public:
+    fastcdc_t();
+    /// throws if min_size < avg_size < max_size <= BLOCK_SIZE does not hold
+    explicit fastcdc_t(params_t params);
+
+    /// length of the chunk at the start of data, length bytes are left in the stream
+    [[nodiscard]] size_t cut(const uint8_t * data, size_t length) const;
+
+    /// lengths of the consecutive chunks of data
+    [[nodiscard]] std::vector < uint32_t > split(const uint8_t * data, size_t length) const;
+
+    [[nodiscard]] const params_t & params() const { return params_; }
+};
+
+#endif //CHUNKER_H
@@ -23,6 +23,9 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
+#include "core/block_buffer.h"
+#include "core/block_key.h"
 
 #ifdef __unix__
 # undef LITTLE_ENDIAN
@@ -31,21 +34,46 @@
 
 enum endian_t { LITTLE_ENDIAN, BIG_ENDIAN };
 
+/* CRC-64/XZ (ECMA-182 polynomial, reflected).
+ * update() runs the fastest kernel the CPU supports, chosen once with cpuid:
+ * VPCLMULQDQ on AVX-512, PCLMULQDQ, or slicing-by-16 over tables generated at compile time */
 class CRC64 {
 public:
-    CRC64();
+    enum kernel_t { TABLE, PCLMUL, VPCLMUL };
+
+    CRC64() = default;
     void update(const uint8_t* data, size_t length);
 
     [[nodiscard]] uint64_t get_checksum(endian_t endian = BIG_ENDIAN
         /* CRC64 tools like 7ZIP display in BIG_ENDIAN */) const;
     [[nodiscard]] std::string get_checksum_str() const;
+    [[nodiscard]] uint64_t get_raw_checksum() const { return crc64_value; }   // running value, no final complement
+
+    [[nodiscard]] static kernel_t active_kernel();
+    [[nodiscard]] static bool kernel_supported(kernel_t kernel);
+    /// advance a raw CRC with a specific kernel, for tests and benchmarks
+    [[nodiscard]] static uint64_t update_with(kernel_t kernel, uint64_t crc, const uint8_t * data, size_t length);
 
 private:
-    uint64_t crc64_value{};
-    uint64_t table[256] {};
+    uint64_t crc64_value = 0xFFFFFFFFFFFFFFFF;
 
-    void init_crc64();
     static uint64_t reverse_bytes(uint64_t x);
 };
 
+/* Whole-file checksums. Unless noted, CRCs here are final values, get_checksum(LITTLE_ENDIAN) */
+
+/// CRC of A followed by B, from the CRCs of A and B and the length of B in bytes
+[[nodiscard]] uint64_t crc64_combine(uint64_t crc_a, uint64_t crc_b, uint64_t length_b);
+
+/// CRC of a buffer, hashed in slices on several threads (0: all cores) and combined
+[[nodiscard]] uint64_t crc64_parallel(const uint8_t * data, size_t length, unsigned threads = 0);
+
+/// CRC of a file, read and hashed in slices on several threads (0: all cores), throws on I/O errors
+[[nodiscard]] uint64_t crc64_file(const std::string & path, unsigned threads = 0);
+
+/// CRC of a file derived from the keys of its zero padded blocks (directory_t::file_t::pages),
+/// without touching the data. Only files stored with CRC64 block keys qualify, throws on any other key
+[[nodiscard]] uint64_t crc64_from_blocks(const std::vector < block_key_t > & pages, uint64_t file_size,
+    uint64_t block_size = BLOCK_SIZE);
+
 #endif //CRC64SUM_H
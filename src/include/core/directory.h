@@ -5,16 +5,16 @@
 #include <string>
 #include <sys/stat.h>
 #include <cstdint>
-
-#define BLOCK_SIZE (1024 * 64) /* 64KB blocks */
+#include "core/block_buffer.h"
+#include "core/block_key.h"
 
 class directory_t {
 public:
     using entry_t = std::string;                        // file name
     using stat_t = struct stat;                         // file stats
-    using page_t = std::vector < uint64_t >;            // file hash pages
+    using page_t = std::vector < block_key_t >;         // file hash pages
     using block_pointers_t = std::vector < uint64_t >;  // block pointers
-    using block_t = std::array <char, BLOCK_SIZE>;
+    using block_t = block_buffer_t;                     // pooled block handle
 
     struct file_t
     {
@@ -1,30 +1,102 @@
 #ifndef G_GLOBAL_CONFIG_T_H
 #define G_GLOBAL_CONFIG_T_H
 
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include "helper/cpp_assert.h"
 #include "helper/err_type.h"
 #include "core/configuration.h"
+#include "core/block_key.h"
 
 using list_view_t = std::vector<std::string>;
 
+/* Configuration resolved once into typed values, defaults applied. A snapshot is never modified
+ * after it is published, readers keep theirs for as long as they hold the pointer. */
+struct config_snapshot_t
+{
+    configuration::configuration_map_t values;  // every key as written, read by get<T>()
+
+    struct {
+        bool verbose;
+        int backtrace_level;
+        bool trim_symbol;
+    } debug;
+
+    struct {
+        bool color;
+    } general;
+
+    struct {
+        std::string listen_addr;
+        int port;
+        std::string dictionary;
+        uint64_t segment_size;          // bytes
+        unsigned network_threads;
+        unsigned io_threads;
+        bool io_uring;
+        unsigned max_inflight;
+        uint64_t max_queued;            // bytes of requests one connection may have waiting for a worker
+        block_hash_t block_hash;
+        uint64_t cache_size;            // bytes of decompressed blocks kept in memory, 0 (or local_cache=false) disables the cache
+        uint64_t gc_interval;           // seconds between block collector passes, 0 disables collection
+        uint64_t gc_bandwidth;          // bytes per second the block collector may copy, 0 disables collection
+    } server;
+};
+
+/// called after a reload published after, before is the snapshot it replaced
+using config_reload_handler_t = std::function < void (const config_snapshot_t & before, const config_snapshot_t & after) >;
+
+/* Hot reload: watch() follows the config file with inotify (the directory is watched, so editors that
+ * replace the file by rename are seen too) and reload() publishes the re-parsed file as a new snapshot.
+ * Handlers registered with on_reload() apply what can change live, everything else keeps the value it
+ * was started with until a restart. */
 extern
 class g_global_config_t {
-    std::unique_ptr < configuration > config;
-    std::mutex mutex;
+    std::atomic < std::shared_ptr < const config_snapshot_t > > snapshot_;
+    std::string path_;
+
+    std::mutex handlers_mutex_;                 // also serializes reloads
+    std::vector < config_reload_handler_t > handlers_;
+
+    std::thread watcher_;
+    int stop_fd_ = -1;
+
+    void watch_loop(int inotify_fd);
+
 public:
+    g_global_config_t() = default;
+    g_global_config_t(const g_global_config_t &) = delete;
+    g_global_config_t & operator=(const g_global_config_t &) = delete;
+    ~g_global_config_t() { stop_watching(); }
+
+    /// parse the config file and publish it, throws and keeps the current snapshot if it is malformed
     void initialize(const std::string & config_file);
 
+    /// re-read the config file and run the reload handlers, returns false and keeps the current
+    /// snapshot if the file is malformed
+    bool reload();
+    void on_reload(config_reload_handler_t handler);
+
+    /// reload whenever the config file changes on disk
+    void watch();
+    void stop_watching();
+
+    /// current snapshot, one atomic load
+    [[nodiscard]] std::shared_ptr < const config_snapshot_t > snapshot() const {
+        return snapshot_.load(std::memory_order_acquire);
+    }
+
     template < typename Type, typename ReturnType = Type >
     requires (std::is_same_v<Type, std::string>
         || std::is_integral_v<Type>
         || std::is_floating_point_v<Type>
         || std::is_same_v<Type, list_view_t>)
-    ReturnType get(const std::string & key)
+    ReturnType get(const std::string & key) const
     {
-        std::lock_guard<std::mutex> lock(mutex);
-
+        const auto config = snapshot();
         if (!config) {
             throw runtime_error("Configuration does not exist");
         }
@@ -39,7 +111,7 @@ public:
         const std::string section_key = key.substr(section_end + 1);
         std::vector<std::string> section_key_value;
         try {
-            section_key_value = config->config.at(section).at(section_key);
+            section_key_value = config->values.at(section).at(section_key);
         }
         catch (const std::out_of_range&)
         {
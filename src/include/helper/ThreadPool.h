@@ -0,0 +1,180 @@
+/* ThreadPool.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include "log.h"
+
+class ThreadPool {
+private:
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> jobs_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+    std::string name_;
+    unsigned retiring_ = 0;                         // workers asked to leave by resize()
+    std::vector<std::thread::id> retired_;          // left, not joined yet
+
+    void worker()
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || retiring_ != 0 || !jobs_.empty(); });
+                if (retiring_ != 0 && !stopping_)
+                {
+                    retiring_--;
+                    retired_.push_back(std::this_thread::get_id());
+                    return;
+                }
+
+                if (jobs_.empty()) {
+                    return; // stopping and drained
+                }
+
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+
+            try {
+                job();
+            } catch (const std::exception & e) {
+                warning_log("Uncaught exception in pooled job: ", e.what());
+            }
+        }
+    }
+
+    void spawn(const unsigned threads)
+    {
+        for (unsigned i = 0; i < threads; i++)
+        {
+            workers_.emplace_back(&ThreadPool::worker, this);
+            pthread_setname_np(workers_.back().native_handle(), name_.substr(0, 15).c_str());
+        }
+    }
+
+public:
+    ThreadPool(unsigned threads, const std::string & name) : name_(name)
+    {
+        threads = std::max(threads, 1u);
+        spawn(threads);
+        debug_log("Thread pool ", name, " started with ", threads, " threads");
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&& other) = delete;
+    ThreadPool& operator=(ThreadPool&& other) = delete;
+
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard lock(mutex_);
+            jobs_.emplace_back(std::move(job));
+        }
+
+        cv_.notify_one();
+    }
+
+    [[nodiscard]] size_t size()
+    {
+        std::lock_guard lock(mutex_);
+        return workers_.size() - retired_.size() - retiring_;
+    }
+
+    /// grow or shrink the pool while it runs, leaving workers finish their current job first
+    void resize(unsigned threads)
+    {
+        threads = std::max(threads, 1u);
+        std::vector<std::thread> finished;
+        {
+            std::lock_guard lock(mutex_);
+            if (stopping_) {
+                return;
+            }
+
+            // join the threads earlier shrinks let go
+            for (auto it = workers_.begin(); it != workers_.end();)
+            {
+                if (std::ranges::find(retired_, it->get_id()) != retired_.end()) {
+                    finished.emplace_back(std::move(*it));
+                    it = workers_.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            retired_.clear();
+            const unsigned current = static_cast<unsigned>(workers_.size()) - retiring_;
+            if (threads > current)
+            {
+                const unsigned cancelled = std::min(retiring_, threads - current);
+                retiring_ -= cancelled;
+                spawn(threads - current - cancelled);
+            }
+            else
+            {
+                retiring_ += current - threads;
+            }
+        }
+
+        cv_.notify_all();
+        for (auto & thread : finished) {
+            thread.join();
+        }
+
+        debug_log("Thread pool ", name_, " resized to ", threads, " threads");
+    }
+
+    /// run every queued job, then join the workers
+    void stop()
+    {
+        {
+            std::lock_guard lock(mutex_);
+            stopping_ = true;
+        }
+
+        cv_.notify_all();
+        for (auto & worker : workers_) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+
+        workers_.clear();
+    }
+
+    ~ThreadPool() { stop(); }
+};
+
+#endif // THREAD_POOL_H
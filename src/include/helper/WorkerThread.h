@@ -27,9 +27,23 @@
 #include <atomic>
 #include <vector>
 #include <chrono>
+#include <utility>
 #include "log.h"
 #include "backtrace.h"
 
+template <typename Function, typename... Args, size_t... Index>
+void invoke_with_any(const Function & function, const std::vector<std::any>& args, std::index_sequence<Index...>)
+{
+    function(std::any_cast<Args>(args[Index])...);
+}
+
+// unpack the arguments start() was given, in the types the worker method expects
+template <typename Function, typename... Args>
+void invoke_with_any(const Function & function, const std::vector<std::any>& args)
+{
+    invoke_with_any<Function, Args...>(function, args, std::index_sequence_for<Args...>{});
+}
+
 class WorkerThread {
 private:
     // Adjust the signature to match the expected lambda signature
@@ -5,6 +5,20 @@
 #include <atomic>
 
 namespace debug {
+    constexpr int max_stack_frames = 64;
+
+    /// return addresses of a call stack, nothing is symbolized until format_backtrace()
+    struct stack_trace_t
+    {
+        void * frames[max_stack_frames] { };
+        int count = 0;
+        int level = 0;      // BACKTRACE_LEVEL at capture time, 0 captures nothing
+    };
+
+    /// cheap enough for every throw, only walks the stack
+    stack_trace_t capture_backtrace();
+    /// symbolize and print, frames seen before come from a process wide address cache
+    std::string format_backtrace(const stack_trace_t & trace);
     std::string backtrace();
     extern std::atomic_int g_pre_defined_level;
     extern std::atomic_bool g_trim_symbol;
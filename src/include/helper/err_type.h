@@ -1,31 +1,55 @@
 #ifndef ERR_TYPE_H
 #define ERR_TYPE_H
 
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include "backtrace.h"
 #include "color.h"
 
 class runtime_error final : public std::runtime_error
 {
-    std::string additional;
+    // shared by copies of the exception, the message is put together on the first what()
+    struct detail_t
+    {
+        debug::stack_trace_t trace;
+        std::once_flag formatted;
+        std::string additional;
+    };
+
+    std::shared_ptr < detail_t > detail;
 public:
-    explicit runtime_error(const std::string& what_arg) : std::runtime_error(what_arg)
+    explicit runtime_error(const std::string& what_arg) : std::runtime_error(what_arg), detail(std::make_shared<detail_t>())
     {
-        additional = color::color(5,0,0) + what_arg + color::no_color();
-        if (const std::string bt = debug::backtrace(); !bt.empty())
-        {
-            additional += "\n";
-            additional += bt;
-        }
-        else
-        {
-            additional += color::color(2,2,0) + "\nSet BACKTRACE_LEVEL=1 or 2 to see detailed backtrace information\n" + color::no_color();
-        }
+        detail->trace = debug::capture_backtrace();
     }
 
     [[nodiscard]] const char* what() const noexcept override
     {
-        return additional.c_str();
+        try
+        {
+            std::call_once(detail->formatted, [this]
+            {
+                std::string additional = color::color(5,0,0) + std::runtime_error::what() + color::no_color();
+                if (const std::string bt = debug::format_backtrace(detail->trace); !bt.empty())
+                {
+                    additional += "\n";
+                    additional += bt;
+                }
+                else
+                {
+                    additional += color::color(2,2,0) + "\nSet BACKTRACE_LEVEL=1 or 2 to see detailed backtrace information\n" + color::no_color();
+                }
+
+                detail->additional = std::move(additional);
+            });
+
+            return detail->additional.c_str();
+        }
+        catch (...)
+        {
+            return std::runtime_error::what();
+        }
     }
 };
 
@@ -0,0 +1,109 @@
+/* io_ring.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <sys/uio.h>
+
+#ifndef USE_IO_URING
+# define USE_IO_URING 0
+#endif
+
+/* Positional file I/O through io_uring.
+ * Callers hand over a batch of requests, the whole batch is queued with a single io_uring_enter and
+ * a dedicated completion thread reaps the results, so one thread can keep a batch worth of reads in
+ * flight. When built without USE_IO_URING, or when the kernel refuses io_uring_setup (old kernels,
+ * seccomp), open() returns false and every batch falls back to blocking pread/pwritev. */
+class io_ring_t {
+public:
+    enum opcode_t : uint8_t { IO_READ, IO_WRITEV };
+    struct batch_t;
+
+    struct request_t
+    {
+        opcode_t opcode = IO_READ;
+        int fd = -1;
+        uint64_t offset = 0;
+        void * buffer = nullptr;        // IO_READ
+        uint32_t length = 0;            // IO_READ
+        const iovec * iov = nullptr;    // IO_WRITEV
+        uint32_t iovcnt = 0;            // IO_WRITEV
+        int64_t result = 0;             // bytes transferred, or -errno
+
+        // owned by submit()
+        batch_t * batch = nullptr;
+        iovec read_iov { };
+    };
+
+private:
+    int ring_fd_ = -1;
+    unsigned entries_ = 0;
+
+    // mapped ring memory
+    void * sq_ring_ = nullptr;
+    void * cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    void * sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned * sq_head_ = nullptr;
+    unsigned * sq_tail_ = nullptr;
+    unsigned * sq_mask_ = nullptr;
+    unsigned * sq_array_ = nullptr;
+    unsigned * cq_head_ = nullptr;
+    unsigned * cq_tail_ = nullptr;
+    unsigned * cq_mask_ = nullptr;
+    void * cqes_ = nullptr;
+
+    std::mutex sq_mutex_;
+    std::mutex slots_mutex_;
+    std::condition_variable slots_cv_;
+    unsigned inflight_ = 0;         // kept below the CQ size so completions are never dropped
+
+    std::thread reaper_;
+
+    void push(const request_t & request, uint64_t user_data);
+    void reap();
+    void unmap();
+    static void fallback(request_t & request);
+
+public:
+    io_ring_t() = default;
+    io_ring_t(const io_ring_t &) = delete;
+    io_ring_t & operator=(const io_ring_t &) = delete;
+    ~io_ring_t() { close(); }
+
+    /// set up a ring with the given queue depth, returns false if io_uring is unavailable
+    bool open(unsigned entries = 256);
+    void close();
+    [[nodiscard]] bool available() const { return ring_fd_ != -1; }
+    [[nodiscard]] unsigned depth() const { return entries_; }
+
+    /// run every request and wait for all of them, results are stored in request.result
+    void submit(request_t * requests, size_t count);
+};
+
+#endif //IO_RING_H
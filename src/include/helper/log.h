@@ -31,13 +31,26 @@
 #include <vector>
 #include <tuple>      // for std::tuple, std::make_tuple
 #include <utility>    // for std::forward
-#include <any>
 #include <cstring>
-#include <regex>
 #include <algorithm>
 #include <ranges>
+#include <cerrno>
+#include <cstdint>
+#include <string_view>
+#include <source_location>
+#include <charconv>
 #include "color.h"
 
+/* Lowest level compiled in at all, calls below it are discarded at compile time.
+ * 0 debug, 1 verbose, 2 warning, 3 error. Debug builds keep everything, release builds drop debug_log. */
+#ifndef LOG_COMPILE_LEVEL
+# if DEBUG
+#  define LOG_COMPILE_LEVEL 0
+# else
+#  define LOG_COMPILE_LEVEL 1
+# endif
+#endif
+
 #define construct_simple_type_compare(type)                             \
     template <typename T>                                               \
     struct is_##type : std::false_type {};                              \
@@ -125,6 +138,10 @@ namespace debug {
     inline class cursor_on_t {} cursor_on;
     construct_simple_type_compare(cursor_on_t);
 
+    // the conjunction keeps sizeof away from manipulators, which are functions
+    template <typename T>
+    concept multibyte_number = std::is_arithmetic_v<T> && (sizeof(T) > 1);
+
     template <typename T>
     struct is_pair : std::false_type
     {
@@ -138,8 +155,83 @@ namespace debug {
     template <typename T>
     constexpr bool is_pair_v = is_pair<T>::value;
 
-    extern std::mutex log_mutex;
-    extern std::atomic_bool verbose;
+    /* Log records are rendered into a thread local buffer on the calling thread, then pushed into a
+     * per thread lock-free ring. A background writer merges the rings, adds caller, level and colors,
+     * and writes every batch to stderr with a single write(2). A full ring drops the record and counts
+     * it, the writer reports the count, a log call never blocks and never takes a lock. */
+    /* Console output sorts above every level, so neither filter ever drops it. */
+    enum log_level_t : uint8_t { LOG_DEBUG, LOG_VERBOSE, LOG_WARNING, LOG_ERROR, LOG_CONSOLE, LOG_PLAIN };
+
+    /// runtime threshold, records below it are discarded before their arguments are evaluated
+    extern std::atomic < log_level_t > log_level;
+
+    [[nodiscard]] inline bool log_enabled(const log_level_t level) {
+        return level >= log_level.load(std::memory_order_relaxed);
+    }
+
+    /// verbose lowers the threshold to LOG_VERBOSE, otherwise it is the build default
+    /// (LOG_DEBUG for debug builds, LOG_WARNING for release builds)
+    void set_verbose(bool enabled);
+    [[nodiscard]] inline bool verbose() { return log_enabled(LOG_VERBOSE); }
+
+    /* "void ns::cls::fn(int) const [with T = int]" to "ns::cls::fn", evaluated by the compiler.
+     * Drops the template argument list, the parameter list with any trailing qualifiers, and the
+     * return type. The result points into the function_name() literal, so it lives forever. */
+    consteval std::string_view caller_name(const char * function_name)
+    {
+        std::string_view name(function_name);
+        if (const auto with = name.find(" [with "); with != std::string_view::npos) {
+            name = name.substr(0, with);
+        }
+
+        // the parameter list is the last ')' that is not inside the <...> of a lambda
+        int angle = 0;
+        for (size_t i = name.size(); i > 0; i--)
+        {
+            const char c = name[i - 1];
+            if (c == '>') angle++;
+            else if (c == '<') angle--;
+            else if (c == ')' && angle == 0)
+            {
+                int paren = 0;
+                for (size_t j = i; j > 0; j--)
+                {
+                    if (name[j - 1] == ')') paren++;
+                    else if (name[j - 1] == '(' && --paren == 0)
+                    {
+                        name = name.substr(0, j - 1);
+                        break;
+                    }
+                }
+
+                break;
+            }
+        }
+
+        // the return type ends at the last space outside of any brackets
+        int depth = 0;
+        size_t start = 0;
+        for (size_t i = 0; i < name.size(); i++)
+        {
+            const char c = name[i];
+            if (c == '<' || c == '(' || c == '[') depth++;
+            else if ((c == '>' || c == ')' || c == ']') && depth > 0) depth--;
+            else if (c == ' ' && depth == 0) start = i + 1;
+        }
+
+        return name.substr(start);
+    }
+
+    /// the calling thread's record buffer, _log() renders into it
+    std::ostream & _record_stream_();
+    /// push what was rendered into _record_stream_() as one record and reset the buffer,
+    /// caller has to outlive the process, as the result of caller_name() does
+    void _commit_record_(log_level_t level, std::string_view caller, int saved_errno);
+    /// wait until every record pushed before the call has been written
+    void flush_log();
+    /// records lost to full rings since start
+    [[nodiscard]] uint64_t dropped_log_records();
+
     template <typename ParamType>
     void _log(const ParamType& param);
     template <typename ParamType, typename... Args>
@@ -205,34 +297,47 @@ namespace debug {
 
     template <typename ParamType> void _log(const ParamType& param)
     {
+        std::ostream & out = _record_stream_();
         // NOLINTBEGIN(clang-diagnostic-repeated-branch-body)
         if constexpr (debug::is_string_v<ParamType>) { // if we don't do it here, it will be assumed as a container
-            std::cerr << param;
+            out << param;
         }
         else if constexpr (debug::is_container_v<ParamType>) {
             debug::print_container(param);
         }
         else if constexpr (debug::is_bool_v<ParamType>) {
-            std::cerr << (param ? "True" : "False");
+            out << (param ? "True" : "False");
         }
         else if constexpr (debug::is_pair_v<ParamType>) {
-            std::cerr << "<";
+            out << "<";
             _log(param.first);
-            std::cerr << ": ";
+            out << ": ";
             _log(param.second);
-            std::cerr << ">";
+            out << ">";
         }
         else if constexpr (debug::is_move_front_t_v<ParamType>) {
-            std::cerr << "\033[F\033[K";
+            out << "\033[F\033[K";
         }
         else if constexpr (debug::is_cursor_off_t_v<ParamType>) {
-            std::cerr << "\033[?25l";
+            out << "\033[?25l";
         }
         else if constexpr (debug::is_cursor_on_t_v<ParamType>) {
-            std::cerr << "\033[?25h";
+            out << "\033[?25h";
+        }
+        else if constexpr (debug::multibyte_number<ParamType>) {
+            // to_chars skips the locale machinery of operator<<, same digits while the stream is untouched
+            char buffer[64];
+            std::to_chars_result result { };
+            if constexpr (std::is_floating_point_v<ParamType>) result = std::to_chars(buffer, std::end(buffer), param, std::chars_format::general, 6);
+            else result = std::to_chars(buffer, std::end(buffer), param);
+            if (out.flags() == (std::ios_base::skipws | std::ios_base::dec) && out.width() == 0 && result.ec == std::errc()) {
+                out.write(buffer, result.ptr - buffer);
+            } else {
+                out << param;
+            }
         }
         else {
-            std::cerr << param;
+            out << param;
         }
         // NOLINTEND(clang-diagnostic-repeated-branch-body)
     }
@@ -244,83 +349,31 @@ namespace debug {
         (_log(args), ...);
     }
 
-    extern bool do_i_show_caller_next_time;
-
-    template < typename StringType >
-    requires (std::is_same_v<StringType, std::string> || std::is_same_v<StringType, std::string_view>)
-    bool _do_i_show_caller_next_time_(const StringType & str)
+    template <typename... Args> void log_with_caller(const log_level_t level, const std::string_view caller, const Args &...args)
     {
-        return (!str.empty() && str.back() == '\n');
-    }
-
-    inline bool _do_i_show_caller_next_time_(const char * str)
-    {
-        return (strlen(str) > 0 && str[strlen(str) - 1] == '\n');
-    }
-
-    inline bool _do_i_show_caller_next_time_(const char c)
-    {
-        return (c == '\n');
-    }
-
-    template<typename T>
-    struct is_char_array : std::false_type {};
-
-    template<std::size_t N>
-    struct is_char_array<char[N]> : std::true_type {};
-
-    template<std::size_t N>
-    struct is_char_array<const char[N]> : std::true_type {};
-
-    extern int caller_max_size;
-
-    template <typename... Args> void log_with_caller(const char * caller, const Args &...args)
-    {
-        std::lock_guard<std::mutex> lock(log_mutex);
         static_assert(sizeof...(Args) > 0, "log(...) requires at least one argument");
-        auto ref_tuple = std::forward_as_tuple(args...);
-        using LastType = std::tuple_element_t<sizeof...(Args) - 1, std::tuple<Args...>>;
-        const std::any last_arg = std::get<sizeof...(Args) - 1>(ref_tuple);
-
-        if (do_i_show_caller_next_time)
-        {
-            const int current_caller_size = static_cast<int>(strlen(caller));
-            if (caller_max_size == 0 || caller_max_size < current_caller_size)
-            {
-                caller_max_size = current_caller_size;
-            }
-
-            _log(color::color(0, 2, 2), "[", caller, "]",
-                std::string(std::max(caller_max_size + 1 - current_caller_size, 1), ' '),
-                color::no_color());
-        }
-
-        if constexpr (!is_char_array<LastType>::value)
-        {
-            do_i_show_caller_next_time = _do_i_show_caller_next_time_(std::any_cast<LastType>(last_arg));
-        }
-        else
-        {
-            do_i_show_caller_next_time = _do_i_show_caller_next_time_(std::any_cast<const char*>(last_arg));
-        }
-
+        const int saved_errno = errno;
         _log(args...);
+        _commit_record_(level, caller, saved_errno);
     }
 
     template <typename... Args> void log(const Args &...args)
     {
-        std::lock_guard<std::mutex> lock(log_mutex);
-        do_i_show_caller_next_time = true;
-        _log(args...);
+        log_with_caller(LOG_PLAIN, "", args...);
     }
 }
 
-#include <source_location>
-namespace debug { std::string _strip_name_(const std::string & name); }
-#define debug_log(...)      if (DEBUG) ::debug::log_with_caller(debug::_strip_name_(std::source_location::current().function_name()).c_str(), color::color(2,2,2), "[DEBUG]:   ", color::color(4,4,4), __VA_ARGS__, color::no_color(), "\n")
-#define verbose_log(...)    if (::debug::verbose) ::debug::log_with_caller(debug::_strip_name_(std::source_location::current().function_name()).c_str(), color::color(2,2,2), "[VERBOSE]: ", color::no_color(), __VA_ARGS__, "\n");
-#define console_log(...)    if (DEBUG) ::debug::log_with_caller(debug::_strip_name_(std::source_location::current().function_name()).c_str(), __VA_ARGS__, "\n"); else ::debug::log(__VA_ARGS__, "\n");
-#define warning_log(...)    ::debug::log_with_caller(debug::_strip_name_(std::source_location::current().function_name()).c_str(), color::color(4,4,0), "[WARNING]: ", color::color(5,5,0), __VA_ARGS__, color::no_color(), "\n")
-#define error_log(...)      ::debug::log_with_caller(debug::_strip_name_(std::source_location::current().function_name()).c_str(), color::color(4,0,0), "[ERROR]:   ", color::color(5,0,0), __VA_ARGS__, errno != 0 ? color::color(5,0,0) : color::color(0,4,0), "errno=", errno, " (", strerror(errno), ")", color::no_color(), "\n")
+#define _log_at_(level, ...) \
+    do { \
+        if constexpr (::debug::level >= LOG_COMPILE_LEVEL) \
+            if (::debug::log_enabled(::debug::level)) \
+                ::debug::log_with_caller(::debug::level, ::debug::caller_name(std::source_location::current().function_name()), __VA_ARGS__); \
+    } while (0)
+
+#define debug_log(...)      _log_at_(LOG_DEBUG, __VA_ARGS__)
+#define verbose_log(...)    _log_at_(LOG_VERBOSE, __VA_ARGS__)
+#define console_log(...)    if (DEBUG) ::debug::log_with_caller(::debug::LOG_CONSOLE, ::debug::caller_name(std::source_location::current().function_name()), __VA_ARGS__); else ::debug::log(__VA_ARGS__);
+#define warning_log(...)    _log_at_(LOG_WARNING, __VA_ARGS__)
+#define error_log(...)      _log_at_(LOG_ERROR, __VA_ARGS__)
 
 #endif // LOG_H
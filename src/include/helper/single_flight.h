@@ -0,0 +1,150 @@
+/* single_flight.h
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/* Coalesces concurrent loads of the same key.
+ * The first caller to join() a key becomes the leader and does the work, everybody joining while
+ * it is in flight waits for the leader's result (value or exception) instead of loading again.
+ * The key is forgotten once the flight lands, the next miss starts a new one, so callers put the
+ * result somewhere visible (a cache) before they finish(). */
+template < typename Key, typename Value, typename Hash = std::hash < Key > >
+class single_flight_t {
+public:
+    class flight_t {
+        friend single_flight_t;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        bool done_ = false;
+        Value value_ { };
+        std::exception_ptr error_;
+
+    public:
+        /// block until the leader lands, rethrows what the leader failed with
+        Value wait()
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return done_; });
+            if (error_) {
+                std::rethrow_exception(error_);
+            }
+
+            return value_;
+        }
+    };
+
+    using flight_ptr = std::shared_ptr < flight_t >;
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    struct alignas(64) shard_t
+    {
+        std::mutex mutex;
+        std::unordered_map < Key, flight_ptr, Hash > flights;
+    };
+
+    std::array < shard_t, shard_count > shards_;
+    std::atomic < uint64_t > coalesced_ { 0 };
+
+    shard_t & shard_of(const Key & key) { return shards_[Hash()(key) % shard_count]; }
+
+    void land(const Key & key, const flight_ptr & flight)
+    {
+        {
+            auto & shard = shard_of(key);
+            std::lock_guard lock(shard.mutex);
+            shard.flights.erase(key);
+        }
+
+        {
+            std::lock_guard lock(flight->mutex_);
+            flight->done_ = true;
+        }
+
+        flight->cv_.notify_all();
+    }
+
+public:
+    /// leader is set if the caller has to load key and then finish() or fail() the flight
+    flight_ptr join(const Key & key, bool & leader)
+    {
+        auto & shard = shard_of(key);
+        std::lock_guard lock(shard.mutex);
+        auto & flight = shard.flights[key];
+        leader = !flight;
+        if (leader) {
+            flight = std::make_shared < flight_t > ();
+        } else {
+            coalesced_.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        return flight;
+    }
+
+    void finish(const Key & key, const flight_ptr & flight, Value value)
+    {
+        flight->value_ = std::move(value);     // nobody reads it before done_ is set
+        land(key, flight);
+    }
+
+    void fail(const Key & key, const flight_ptr & flight, std::exception_ptr error)
+    {
+        flight->error_ = std::move(error);
+        land(key, flight);
+    }
+
+    /// load key with loader, or wait for the load already in flight
+    template < typename Loader >
+    Value run(const Key & key, Loader && loader)
+    {
+        bool leader;
+        const auto flight = join(key, leader);
+        if (!leader) {
+            return flight->wait();
+        }
+
+        try
+        {
+            Value value = loader();
+            finish(key, flight, value);
+            return value;
+        }
+        catch (...)
+        {
+            fail(key, flight, std::current_exception());
+            throw;
+        }
+    }
+
+    /// callers that waited for another caller's load instead of loading
+    [[nodiscard]] uint64_t coalesced() const { return coalesced_.load(std::memory_order_relaxed); }
+};
+
+#endif //SINGLE_FLIGHT_H
@@ -1,11 +1,32 @@
 #if DEBUG
 
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <random>
 #include <thread>
 #include <cstring>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "test/test.h"
 #include "helper/lz4.h"
 #include "core/configuration.h"
+#include "core/g_global_config_t.h"
+#include "core/block_buffer.h"
+#include "core/crc64sum.h"
+#include "core/block_key.h"
+#include "core/bin2hex.h"
+#include "core/base64.h"
+#include "core/cache.h"
+#include "core/chunker.h"
+#include "helper/base64.hpp"
+#include "helper/log.h"
+#include "helper/err_type.h"
+#include "helper/single_flight.h"
+#include "helper/WorkerThread.h"
+#include "../backend/segment_store.h"
 
 class simple_unit_test_ final : test::unit_t {
 public:
@@ -171,10 +192,976 @@ public:
         } catch (...) {
         }
 
-        return true;
+        // typed snapshot, replaced as a whole while earlier readers keep theirs
+        g_global_config.initialize(SOURCE_DIR "/example.config");
+        const auto first = g_global_config.snapshot();
+        if (first->server.port != 5080 || first->server.segment_size != 1024ull * 1024 * 1024
+            || first->server.max_inflight != 64 || first->server.max_queued != 64ull * 1024 * 1024 || !first->server.io_uring || first->server.network_threads < 2
+            || first->server.block_hash != BLOCK_HASH_XXH3_128 || g_global_config.get<int>("server.port") != 5080) {
+            return false;
+        }
+
+        try {
+            g_global_config.initialize(SOURCE_DIR "/example.not-existing.config");
+            return false;
+        } catch (...) {
+        }
+
+        if (g_global_config.snapshot() != first) {
+            return false;
+        }
+
+        g_global_config.initialize(SOURCE_DIR "/example.config");
+        if (g_global_config.snapshot() == first || first->server.port != 5080) {
+            return false;
+        }
+
+        // reload runs the handlers with both snapshots, a malformed file keeps the current one
+        const std::string path = std::filesystem::temp_directory_path() / "fss_reload_test.config";
+        std::filesystem::copy_file(SOURCE_DIR "/example.config", path, std::filesystem::copy_options::overwrite_existing);
+        g_global_config.initialize(path);
+        const auto reloads = std::make_shared<int>(0);     // handlers stay registered after the test
+        g_global_config.on_reload([reloads](const config_snapshot_t & before, const config_snapshot_t & after) {
+            *reloads += before.values.contains("extra") ? 0 : after.values.contains("extra");
+        });
+
+        std::ofstream(path, std::ios::app) << "[extra]\nkey=value\n";
+        if (!g_global_config.reload() || *reloads != 1 || g_global_config.get<std::string>("extra.key") != "value") {
+            return false;
+        }
+
+        std::ofstream(path, std::ios::app) << "[server]\nport=x\n";
+        const bool malformed_kept = !g_global_config.reload() && g_global_config.get<std::string>("extra.key") == "value";
+        std::filesystem::remove(path);
+        return malformed_kept && *reloads == 1;
     }
 } config_test;
 
+class block_buffer_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Block buffer test";
+    }
+
+    std::string success() override {
+        return "Block buffer test succeeded";
+    }
+
+    std::string failure() override {
+        return "Block buffer test failed";
+    }
+
+    bool run() override
+    {
+        const char * pooled;
+        {
+            auto block = block_buffer_t::allocate();
+            pooled = block.data();
+            std::memset(block.data(), 0x5A, block.size());
+
+            auto shared = block;    // copies share the same buffer
+            if (shared.data() != block.data() || block.unique() || shared.view() != block.view()) {
+                return false;
+            }
+
+            const auto moved = std::move(shared);
+            if (shared || moved.data() != pooled || block.unique()) {
+                return false;
+            }
+
+            block.resize(100);
+            if (moved.size() != 100 || moved.view() != std::string(100, 0x5A)) {
+                return false;
+            }
+        }
+
+        // the last handle returned the buffer to the pool, next allocation should reuse it
+        const auto block = block_buffer_t::allocate(16);
+        return block.data() == pooled && block.unique() && block.size() == 16;
+    }
+} block_buffer_test;
+
+class crc64_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "CRC64 test";
+    }
+
+    std::string success() override {
+        return "CRC64 test succeeded";
+    }
+
+    std::string failure() override {
+        return "CRC64 test failed";
+    }
+
+    // the original byte-at-a-time implementation, slicing must match it bit for bit
+    static uint64_t reference(const uint8_t * data, const size_t length)
+    {
+        uint64_t table[256];
+        for (uint64_t i = 0; i < 256; ++i) {
+            uint64_t crc = i;
+            for (int j = 0; j < 8; ++j) crc = (crc & 1) ? (crc >> 1) ^ 0xC96C5795D7870F42 : crc >> 1;
+            table[i] = crc;
+        }
+
+        uint64_t crc = 0xFFFFFFFFFFFFFFFF;
+        for (size_t i = 0; i < length; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+    bool run() override
+    {
+        // CRC-64/XZ check value
+        CRC64 check;
+        check.update(reinterpret_cast<const uint8_t *>("123456789"), 9);
+        if (check.get_checksum(LITTLE_ENDIAN) != 0x995DC9BBDF1939FA) {
+            return false;
+        }
+
+        std::vector < uint8_t > data(BLOCK_SIZE + 64);
+        uint64_t seed = 0x9E3779B97F4A7C15;
+        for (auto & byte : data) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            byte = static_cast<uint8_t>(seed >> 56);
+        }
+
+        // every kernel this CPU runs, across every tail length and misalignment around the
+        // 16/64/256/512 byte strides, then a whole block
+        for (const auto kernel : { CRC64::TABLE, CRC64::PCLMUL, CRC64::VPCLMUL })
+        {
+            if (!CRC64::kernel_supported(kernel)) {
+                continue;
+            }
+
+            for (size_t offset = 0; offset < 8; offset++) {
+                for (size_t length = 0; length < 1100; length += length < 80 ? 1 : 13) {
+                    if (CRC64::update_with(kernel, 0xFFFFFFFFFFFFFFFF, data.data() + offset, length)
+                        != reference(data.data() + offset, length))
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            if (CRC64::update_with(kernel, 0x0123456789ABCDEF, data.data(), BLOCK_SIZE + 63)
+                != CRC64::update_with(CRC64::TABLE, 0x0123456789ABCDEF, data.data(), BLOCK_SIZE + 63))
+            {
+                return false;
+            }
+        }
+
+        CRC64 pieces;
+        for (size_t done = 0, step = 1; done < BLOCK_SIZE; done += step, step = step * 3 % 1021 + 1) {
+            pieces.update(data.data() + done, std::min(step, BLOCK_SIZE - done));
+        }
+
+        return pieces.get_raw_checksum() == reference(data.data(), BLOCK_SIZE);
+    }
+} crc64_test;
+
+class crc64_combine_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "CRC64 combine test";
+    }
+
+    std::string success() override {
+        return "CRC64 combine test succeeded";
+    }
+
+    std::string failure() override {
+        return "CRC64 combine test failed";
+    }
+
+    static uint64_t serial(const uint8_t * data, const size_t length)
+    {
+        CRC64 crc;
+        crc.update(data, length);
+        return crc.get_checksum(LITTLE_ENDIAN);
+    }
+
+    bool run() override
+    {
+        std::vector < uint8_t > data(5 * BLOCK_SIZE + 1234);
+        uint64_t seed = 0x2545F4914F6CDD1D;
+        for (auto & byte : data) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            byte = static_cast<uint8_t>(seed);
+        }
+
+        for (const size_t a : { 0, 1, 7, 100, BLOCK_SIZE, BLOCK_SIZE + 3 }) {
+            for (const size_t b : { 0, 1, 9, 4096, 3 * BLOCK_SIZE }) {
+                if (crc64_combine(serial(data.data(), a), serial(data.data() + a, b), b) != serial(data.data(), a + b)) {
+                    return false;
+                }
+            }
+        }
+
+        for (const unsigned threads : { 1, 2, 3, 8 }) {
+            if (crc64_parallel(data.data(), data.size(), threads) != serial(data.data(), data.size())) {
+                return false;
+            }
+        }
+
+        // file checksum from the CRCs of zero padded blocks, for full and partial last blocks
+        for (const size_t length : { 0, 1, BLOCK_SIZE - 1, BLOCK_SIZE, BLOCK_SIZE + 1, 5 * BLOCK_SIZE + 1234 })
+        {
+            std::vector < block_key_t > pages;
+            for (size_t offset = 0; offset < length; offset += BLOCK_SIZE)
+            {
+                std::vector < char > block(BLOCK_SIZE, 0);
+                std::memcpy(block.data(), data.data() + offset, std::min<size_t>(BLOCK_SIZE, length - offset));
+                pages.push_back(block_key_of(block.data(), block.size(), BLOCK_HASH_CRC64));
+            }
+
+            if (crc64_from_blocks(pages, length) != serial(data.data(), length)) {
+                return false;
+            }
+        }
+
+        // files stored under XXH3 keys can not be checked this way
+        try {
+            (void)crc64_from_blocks({ block_key_of(reinterpret_cast<const char *>(data.data()), BLOCK_SIZE, BLOCK_HASH_XXH3_128) }, BLOCK_SIZE);
+            return false;
+        } catch (const std::exception &) {
+        }
+
+        return true;
+    }
+} crc64_combine_test;
+
+class block_key_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Block key test";
+    }
+
+    std::string success() override {
+        return "Block key test succeeded";
+    }
+
+    std::string failure() override {
+        return "Block key test failed";
+    }
+
+    bool run() override
+    {
+        // XXH3-128 of the empty input
+        if (block_key_of(nullptr, 0, BLOCK_HASH_XXH3_128) != block_key_t { 0x6001C324468D497FULL, 0x99AA06D3014798D8ULL }) {
+            return false;
+        }
+
+        // CRC64 keys are the raw checksum, as the v0 segment records stored them
+        const std::string data = "123456789";
+        CRC64 crc;
+        crc.update(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        if (block_key_of(data.data(), data.size(), BLOCK_HASH_CRC64) != block_key_t { crc.get_raw_checksum(), 0 }) {
+            return false;
+        }
+
+        // names: canonical XXH3 form as xxh128sum prints it, CRC64 names are the in-memory value
+        block_key_t parsed;
+        if (block_key_to_name(block_key_of(nullptr, 0, BLOCK_HASH_XXH3_128)) != "99aa06d3014798d86001c324468d497f"
+            || !block_name_to_key("99AA06D3014798D86001C324468D497F", parsed)
+            || parsed != block_key_of(nullptr, 0, BLOCK_HASH_XXH3_128)
+            || block_key_to_name(block_key_t { 0x0123456789ABCDEFULL, 0 }) != "efcdab8967452301"
+            || !block_name_to_key("efcdab8967452301", parsed) || parsed != block_key_t { 0x0123456789ABCDEFULL, 0 }
+            || block_name_to_key("efcdab896745230", parsed) || block_name_to_key("efcdab896745230g", parsed)) {
+            return false;
+        }
+
+        return block_hash_from_name(block_hash_name(BLOCK_HASH_XXH3_128)) == BLOCK_HASH_XXH3_128
+            && block_hash_from_name(block_hash_name(BLOCK_HASH_CRC64)) == BLOCK_HASH_CRC64;
+    }
+} block_key_test;
+
+class hex_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Hex codec test";
+    }
+
+    std::string success() override {
+        return "Hex codec test succeeded";
+    }
+
+    std::string failure() override {
+        return "Hex codec test failed";
+    }
+
+    bool run() override
+    {
+        if (bin2hex::bin2hex(std::string("\x01\xab\xff\x10", 4)) != "01abff10") {
+            return false;
+        }
+
+        std::vector < uint8_t > data(300);
+        uint64_t seed = 0x9E3779B97F4A7C15;
+        for (auto & byte : data) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            byte = static_cast<uint8_t>(seed);
+        }
+
+        // every kernel against the scalar one, over lengths that hit each vector width and its tails
+        for (const auto kernel : { bin2hex::SCALAR, bin2hex::SSSE3, bin2hex::AVX2 })
+        {
+            if (!bin2hex::kernel_supported(kernel)) {
+                continue;
+            }
+
+            for (size_t length = 0; length <= data.size(); length += length < 70 ? 1 : 37)
+            {
+                std::string expected(length * 2, '\0'), hex(length * 2, '\0');
+                bin2hex::encode_with(bin2hex::SCALAR, data.data(), length, expected.data());
+                bin2hex::encode_with(kernel, data.data(), length, hex.data());
+                if (hex != expected) {
+                    return false;
+                }
+
+                std::vector < uint8_t > decoded(length);
+                if (!bin2hex::decode_with(kernel, hex.data(), hex.size(), decoded.data())
+                    || !std::equal(decoded.begin(), decoded.end(), data.begin())) {
+                    return false;
+                }
+
+                // uppercase decodes the same, any non hex digit anywhere is rejected
+                for (auto & c : hex) c = static_cast<char>(std::toupper(c));
+                if (!bin2hex::decode_with(kernel, hex.data(), hex.size(), decoded.data())
+                    || !std::equal(decoded.begin(), decoded.end(), data.begin())) {
+                    return false;
+                }
+
+                for (size_t i = 0; i < hex.size(); i += 7)
+                {
+                    for (const char bad : { 'g', 'G', '/', ':', '@', '`', '\0', '\x80', '\xc6' })
+                    {
+                        std::string broken = hex;
+                        broken[i] = bad;
+                        if (bin2hex::decode_with(kernel, broken.data(), broken.size(), decoded.data())) {
+                            return false;
+                        }
+                    }
+                }
+            }
+        }
+
+        return !bin2hex::decode("abc", 3, data.data());
+    }
+} hex_test;
+
+class base64_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Base64 test";
+    }
+
+    std::string success() override {
+        return "Base64 test succeeded";
+    }
+
+    std::string failure() override {
+        return "Base64 test failed";
+    }
+
+    static bool rejects(const base64::kernel_t kernel, const std::string & text)
+    {
+        std::vector < char > out(text.size());
+        try {
+            (void)base64::decode_with(kernel, text, out.data(), out.size());
+        } catch (const std::runtime_error &) {
+            return true;
+        }
+
+        return false;
+    }
+
+    bool run() override
+    {
+        std::string data(400, '\0');
+        uint64_t seed = 0xD1B54A32D192ED03;
+        for (auto & byte : data) {
+            seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+            byte = static_cast<char>(seed);
+        }
+
+        // every kernel against the scalar codec of helper/base64.hpp, lengths cover each step size and tail
+        for (const auto kernel : { base64::SCALAR, base64::SSSE3, base64::AVX2 })
+        {
+            if (!base64::kernel_supported(kernel)) {
+                continue;
+            }
+
+            for (size_t length = 0; length <= data.size(); length += length < 100 ? 1 : 29)
+            {
+                const std::string_view input(data.data(), length);
+                std::string text(base64::encoded_size(length), '\0');
+                base64::encode_with(kernel, input.data(), length, text.data());
+                if (text != base64::to_base64(input)) {
+                    return false;
+                }
+
+                std::string decoded(length, '\0');
+                if (base64::decode_with(kernel, text, decoded.data(), decoded.size()) != length || decoded != input) {
+                    return false;
+                }
+
+                // characters outside the alphabet, including a misplaced '=', anywhere in the text
+                for (size_t i = 0; i + 2 < text.size(); i += 5)
+                {
+                    for (const char bad : { '=', '-', '_', ' ', '\n', '\0', '\x7f', '\x80', '\xff', '@', '[', '`', '{', ':' })
+                    {
+                        std::string broken = text;
+                        broken[i] = bad;
+                        if (!rejects(kernel, broken)) {
+                            return false;
+                        }
+                    }
+                }
+            }
+
+            if (!rejects(kernel, "abc") || !rejects(kernel, "a===") || !rejects(kernel, "ab=c")) {
+                return false;
+            }
+        }
+
+        // decoded data has to fit the caller buffer
+        char small[2];
+        try {
+            (void)base64::decode("AAAA", small, sizeof(small));
+            return false;
+        } catch (const std::runtime_error &) { }
+
+        return base64::decoded_size("") == 0 && base64::decoded_size("AA==") == 1 && base64::decoded_size("AAA=") == 2;
+    }
+} base64_test;
+
+class log_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Log test";
+    }
+
+    std::string success() override {
+        return "Log test succeeded";
+    }
+
+    std::string failure() override {
+        return "Log test failed";
+    }
+
+    bool run() override
+    {
+        static_assert(debug::caller_name("int main(int, char**)") == "main");
+        static_assert(debug::caller_name("void ns::cls::fn(int) const") == "ns::cls::fn");
+        static_assert(debug::caller_name("const std::map<int, int>& cls::get() const") == "cls::get");
+        static_assert(debug::caller_name("bool cls::operator()(int)") == "cls::operator()");
+        static_assert(debug::caller_name("void fn(T) [with T = std::pair<int, int>]") == "fn");
+        static_assert(debug::caller_name("void cls::run()::<lambda(int)>") == "cls::run");  // the enclosing function
+
+        constexpr int threads = 4;
+        constexpr int records = 500;
+        const std::string path = std::filesystem::temp_directory_path() / "fss_log_test.log";
+
+        // capture what the writer sends to stderr
+        debug::flush_log();
+        const int saved_stderr = dup(STDERR_FILENO);
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (saved_stderr == -1 || fd == -1) {
+            return false;
+        }
+
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+
+        const uint64_t dropped_before = debug::dropped_log_records();
+        std::vector < std::thread > workers;
+        for (int t = 0; t < threads; t++)
+        {
+            workers.emplace_back([t] {
+                for (int i = 0; i < records; i++) {
+                    warning_log("record ", t, " ", i);
+                }
+            });
+        }
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        // stream state does not leak into the next record
+        warning_log("hex ", std::hex, 255);
+        warning_log("dec ", 255);
+
+        // below the runtime threshold the arguments are not even evaluated
+        bool evaluated = false;
+        const auto level = debug::log_level.load();
+        debug::log_level = debug::LOG_ERROR;
+        warning_log("filtered ", evaluated = true);
+        debug::log_level = level;
+        debug::flush_log();
+        const uint64_t dropped = debug::dropped_log_records() - dropped_before;
+
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+
+        std::ifstream ifs(path);
+        std::string line;
+        std::vector < int > last(threads, -1);
+        uint64_t seen = 0;
+        bool hex = false, dec = false;
+        while (std::getline(ifs, line))
+        {
+            hex |= line.find("hex ff") != std::string::npos;
+            dec |= line.find("dec 255") != std::string::npos;
+            int t, i;
+            const auto pos = line.find("record ");
+            if (pos == std::string::npos || std::sscanf(line.c_str() + pos, "record %d %d", &t, &i) != 2) {
+                continue;
+            }
+
+            // every thread's records come out in the order it logged them
+            if (t < 0 || t >= threads || i <= last[t]) {
+                return false;
+            }
+
+            last[t] = i;
+            seen++;
+        }
+
+        std::filesystem::remove(path);
+        return hex && dec && !evaluated && seen + dropped == threads * records;
+    }
+} log_test;
+
+class backtrace_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Backtrace test";
+    }
+
+    std::string success() override {
+        return "Backtrace test succeeded";
+    }
+
+    std::string failure() override {
+        return "Backtrace test failed";
+    }
+
+    bool run() override
+    {
+        const int level = debug::g_pre_defined_level;
+        auto thrown = [](const int with_level) -> runtime_error
+        {
+            debug::g_pre_defined_level = with_level;
+            try {
+                throw runtime_error("backtrace test");
+            } catch (const runtime_error & e) {
+                return e;
+            }
+        };
+
+        // frames are captured at the throw, symbolized on the first what(), shared by copies
+        const runtime_error traced = thrown(1);
+        const runtime_error copy = traced;
+        const std::string text = copy.what();
+        const bool ok = text.find("backtrace test") != std::string::npos && text.find("Frame #0") != std::string::npos
+            && traced.what() == copy.what();
+
+        // the level in effect at the throw decides, not the one at what()
+        const runtime_error untraced = thrown(0);
+        debug::g_pre_defined_level = 1;
+        const bool hint = std::string(untraced.what()).find("Set BACKTRACE_LEVEL") != std::string::npos;
+
+        debug::g_pre_defined_level = level;
+        return ok && hint;
+    }
+} backtrace_test;
+
+class block_cache_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Block cache test";
+    }
+
+    std::string success() override {
+        return "Block cache test succeeded";
+    }
+
+    std::string failure() override {
+        return "Block cache test failed";
+    }
+
+    bool run() override
+    {
+        block_cache_t cache;
+        auto block_of = [](const uint64_t id)
+        {
+            auto block = block_buffer_t::allocate();
+            std::memset(block.data(), static_cast<int>(id), block.size());
+            return block;
+        };
+
+        auto key_of = [](const uint64_t id) { return block_key_of(reinterpret_cast<const char *>(&id), sizeof(id), BLOCK_HASH_XXH3_128); };
+
+        // disabled until it has a budget
+        block_buffer_t found;
+        cache.insert(key_of(0), block_of(0));
+        if (cache.lookup(key_of(0), found)) {
+            return false;
+        }
+
+        constexpr uint64_t hot = 256;
+        cache.resize(hot * 2 * BLOCK_SIZE);
+
+        // a hit shares the inserted buffer
+        const auto first = block_of(1);
+        cache.insert(key_of(1), first);
+        if (!cache.lookup(key_of(1), found) || found.data() != first.data()) {
+            return false;
+        }
+
+        // a working set read over and over, then a scan of blocks read once
+        for (int round = 0; round < 4; round++)
+        {
+            for (uint64_t id = 0; id < hot; id++)
+            {
+                if (block_buffer_t block; !cache.lookup(key_of(id), block)) {
+                    cache.insert(key_of(id), block_of(id));
+                }
+            }
+        }
+
+        for (uint64_t id = 1000; id < 1000 + hot * 8; id++)
+        {
+            if (block_buffer_t block; !cache.lookup(key_of(id), block)) {
+                cache.insert(key_of(id), block_of(id));
+            }
+        }
+
+        uint64_t survived = 0;
+        for (uint64_t id = 0; id < hot; id++) {
+            if (cache.lookup(key_of(id), found) && static_cast<uint8_t>(found.data()[0]) == static_cast<uint8_t>(id)) {
+                survived++;
+            }
+        }
+
+        auto stats = cache.stats();
+        if (survived < hot * 9 / 10 || stats.bytes > cache.capacity() || stats.rejected == 0) {
+            return false;
+        }
+
+        // shrinking evicts right away, 0 empties the cache
+        cache.resize(hot / 2 * BLOCK_SIZE);
+        stats = cache.stats();
+        if (stats.bytes > cache.capacity()) {
+            return false;
+        }
+
+        cache.erase(key_of(1));
+        if (cache.lookup(key_of(1), found)) {
+            return false;
+        }
+
+        cache.resize(0);
+        if (cache.stats().entries != 0) {
+            return false;
+        }
+
+        // a short chunk is charged for the whole buffer it pins
+        cache.resize(hot * 2 * BLOCK_SIZE);
+        auto chunk = block_of(2);
+        chunk.resize(100);
+        cache.insert(key_of(2), chunk);
+        if (cache.stats().bytes != sizeof(block_buffer_t::storage_t)) {
+            return false;
+        }
+
+        // the smallest budget that is not warned about still keeps the blocks read again
+        cache.resize(cache.min_capacity());
+        for (uint64_t id = 3000; id < 3064; id++)
+        {
+            cache.insert(key_of(id), block_of(id));
+            if (!cache.lookup(key_of(id), found)) {
+                return false;
+            }
+        }
+
+        return cache.stats().entries != 0;
+    }
+} block_cache_test;
+
+class single_flight_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Single flight test";
+    }
+
+    std::string success() override {
+        return "Single flight test succeeded";
+    }
+
+    std::string failure() override {
+        return "Single flight test failed";
+    }
+
+    bool run() override
+    {
+        single_flight_t < uint64_t, std::shared_ptr < int > > flights;
+        std::atomic < int > loads { 0 };
+        auto slow_load = [&]
+        {
+            loads++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            return std::make_shared < int > (42);
+        };
+
+        // everybody missing the same key at once shares one load and one buffer
+        constexpr int readers = 8;
+        std::vector < std::shared_ptr < int > > results(readers);
+        std::vector < std::thread > threads;
+        for (int i = 0; i < readers; i++) {
+            threads.emplace_back([&, i] { results[i] = flights.run(7, slow_load); });
+        }
+
+        for (auto & thread : threads) thread.join();
+        if (loads != 1 || flights.coalesced() != readers - 1) {
+            return false;
+        }
+
+        for (const auto & result : results) {
+            if (result != results[0] || *result != 42) return false;
+        }
+
+        // a landed key is loaded again, a failed load reaches every waiter
+        threads.clear();
+        std::atomic < int > failed { 0 };
+        for (int i = 0; i < readers; i++)
+        {
+            threads.emplace_back([&]
+            {
+                try {
+                    flights.run(7, [&]() -> std::shared_ptr < int > {
+                        loads++;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                        throw runtime_error("load failed");
+                    });
+                } catch (const runtime_error &) {
+                    failed++;
+                }
+            });
+        }
+
+        for (auto & thread : threads) thread.join();
+        return loads == 2 && failed == readers;
+    }
+} single_flight_test;
+
+class worker_thread_test_ final : test::unit_t {
+    std::atomic < int > rounds_ { 0 };
+    std::atomic < int > sum_ { 0 };
+
+    void work(std::atomic < bool > & running, const int step)
+    {
+        while (running) {
+            sum_ += step;
+            rounds_++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+public:
+    std::string name() override {
+        return "Worker thread test";
+    }
+
+    std::string success() override {
+        return "Worker thread test succeeded";
+    }
+
+    std::string failure() override {
+        return "Worker thread test failed";
+    }
+
+    bool run() override
+    {
+        WorkerThread worker(this, &worker_thread_test_::work);
+        int step = 3;
+        worker.start(step);
+        while (rounds_ < 10) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        worker.stop();
+        const int rounds = rounds_;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return rounds_ == rounds && sum_ == rounds * step;
+    }
+} worker_thread_test;
+
+class fastcdc_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "FastCDC test";
+    }
+
+    std::string success() override {
+        return "FastCDC test succeeded";
+    }
+
+    std::string failure() override {
+        return "FastCDC test failed";
+    }
+
+    bool run() override
+    {
+        const fastcdc_t chunker;
+        const auto & params = chunker.params();
+        std::vector < uint8_t > data(8 * 1024 * 1024);
+        std::mt19937_64 rng(7);
+        for (auto & byte : data) byte = static_cast<uint8_t>(rng());
+
+        // chunks cover the data, and only the last one may be shorter than min_size
+        const auto chunks = chunker.split(data.data(), data.size());
+        size_t total = 0;
+        for (size_t i = 0; i < chunks.size(); i++)
+        {
+            if (chunks[i] > params.max_size || (chunks[i] < params.min_size && i + 1 != chunks.size())) {
+                return false;
+            }
+
+            total += chunks[i];
+        }
+
+        const size_t average = data.size() / chunks.size();
+        if (total != data.size() || average < params.avg_size / 2 || average > params.avg_size * 2) {
+            return false;
+        }
+
+        // an insert near the start moves every later boundary along with the content
+        auto edited = data;
+        edited.insert(edited.begin() + 100, { 1, 2, 3 });
+        auto boundaries = [](const std::vector < uint32_t > & lengths, const size_t shift)
+        {
+            std::vector < size_t > ends;
+            size_t offset = shift;
+            for (const auto length : lengths) ends.push_back(offset += length);
+            return ends;
+        };
+
+        const auto before = boundaries(chunks, 3);
+        const auto after = boundaries(chunker.split(edited.data(), edited.size()), 0);
+        size_t shared = 0;
+        for (const auto end : after) shared += std::ranges::binary_search(before, end);
+        if (shared + 2 < after.size()) {
+            return false;
+        }
+
+        // sizes out of order are rejected
+        try {
+            fastcdc_t bad({ .min_size = 64 * 1024, .avg_size = 32 * 1024, .max_size = BLOCK_SIZE });
+            return false;
+        } catch (const std::exception &) {
+            return true;
+        }
+    }
+} fastcdc_test;
+
+class segment_compact_test_ final : test::unit_t {
+public:
+    std::string name() override {
+        return "Segment compaction test";
+    }
+
+    std::string success() override {
+        return "Segment compaction test succeeded";
+    }
+
+    std::string failure() override {
+        return "Segment compaction test failed";
+    }
+
+    bool run() override
+    {
+        const std::string directory = std::filesystem::temp_directory_path() / "fss_segment_compact_test";
+        std::filesystem::remove_all(directory);
+
+        // small segments, the first one is sealed after some 60 records
+        segment_store_t store;
+        store.open(directory, 64 * 1024, false);
+        std::vector < block_key_t > keys;
+        std::vector < char > payload(1000);
+        for (uint64_t id = 0; id < 200; id++)
+        {
+            std::memset(payload.data(), static_cast<int>(id), payload.size());
+            std::memcpy(payload.data(), &id, sizeof(id));
+            keys.push_back(block_key_of(payload.data(), payload.size(), BLOCK_HASH_XXH3_128));
+            store.append(keys.back(), BLOCK_HASH_XXH3_128, payload.data(), static_cast<uint32_t>(payload.size()));
+        }
+
+        // every fourth block of the first segment stays, the others lose their reference
+        std::vector < size_t > released;
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            if (segment_store_t::location_t location{}; store.find(keys[i], location) && location.segment == 0 && i % 4 != 0)
+            {
+                store.release(keys[i]);
+                released.push_back(i);
+            }
+        }
+
+        // stores of the released blocks race the compaction from the other end of the segment,
+        // a store the index took must survive it
+        std::vector < bool > revived(keys.size());
+        std::atomic < bool > compacting = false;
+        std::thread writer([&]
+        {
+            while (!compacting) {
+                std::this_thread::yield();
+            }
+
+            for (auto i = released.rbegin(); i != released.rend(); ++i)
+            {
+                revived[*i] = store.reference(keys[*i]);
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+
+        const auto dropped = store.compact(0, [&](uint64_t) {
+            compacting = true;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            return true;
+        });
+
+        writer.join();
+        bool ok = true;
+        for (size_t i = 0; i < keys.size() && ok; i++)
+        {
+            const bool gone = std::ranges::find(dropped, keys[i]) != dropped.end();
+            segment_store_t::location_t location{};
+            if (gone) {
+                ok = !revived[i] && !store.find(keys[i], location);
+                continue;
+            }
+
+            // kept blocks are copied out of the sealed segment and still read back
+            const bool unreferenced = std::ranges::find(released, i) != released.end() && !revived[i];
+            ok = !unreferenced && store.find(keys[i], location) && location.segment != 0;
+            if (ok)
+            {
+                std::vector < char > content(payload.size());
+                store.read(location, content.data());
+                uint64_t id;
+                std::memcpy(&id, content.data(), sizeof(id));
+                ok = id == i && static_cast<uint8_t>(content.back()) == static_cast<uint8_t>(i);
+            }
+        }
+
+        store.close();
+        std::filesystem::remove_all(directory);
+        return ok && !dropped.empty() && std::ranges::find(revived, true) != revived.end();
+    }
+} segment_compact_test;
 
 class vterm_test_ final : test::unit_t {
 public:
@@ -204,6 +1191,13 @@ std::map < std::string, void * > test::unit_tests = {
     // unit test dummies end
 
     { "LZ4", &lz4_test }, { "Config", &config_test }, // utilities
+    { "BlockBuffer", &block_buffer_test },
+    { "CRC64", &crc64_test }, { "CRC64Combine", &crc64_combine_test },
+    { "BlockKey", &block_key_test }, { "Hex", &hex_test }, { "Base64", &base64_test },
+    { "Log", &log_test }, { "Backtrace", &backtrace_test },
+    { "BlockCache", &block_cache_test }, { "SingleFlight", &single_flight_test },
+    { "WorkerThread", &worker_thread_test }, { "FastCDC", &fastcdc_test },
+    { "SegmentCompact", &segment_compact_test },
     { "vterm", &vterm_test },
 };
 
@@ -0,0 +1,101 @@
+/* chunk_bench.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* FastCDC throughput, and how much of an edited file deduplicates against the original.
+ *
+ *   chunk_bench [MB of data] [min avg max in KB]
+ *
+ * The edit inserts one byte near the start, fixed BLOCK_SIZE blocks lose every block after it. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_set>
+#include <vector>
+#include "core/block_key.h"
+#include "core/chunker.h"
+
+namespace {
+    struct key_hash_t
+    {
+        size_t operator()(const block_key_t & key) const { return key.lo; }
+    };
+
+    using key_set_t = std::unordered_set < block_key_t, key_hash_t >;
+
+    key_set_t keys_of(const std::vector < uint8_t > & data, const std::vector < uint32_t > & chunks)
+    {
+        key_set_t keys;
+        size_t offset = 0;
+        for (const uint32_t chunk : chunks) {
+            keys.insert(block_key_of(reinterpret_cast<const char *>(data.data() + offset), chunk, BLOCK_HASH_XXH3_128));
+            offset += chunk;
+        }
+
+        return keys;
+    }
+
+    std::vector < uint32_t > fixed_blocks(const size_t length)
+    {
+        std::vector < uint32_t > blocks(length / BLOCK_SIZE, BLOCK_SIZE);
+        if (length % BLOCK_SIZE) blocks.push_back(length % BLOCK_SIZE);
+        return blocks;
+    }
+
+    // share of the edited file's chunks that are already stored from the original
+    double reused(const key_set_t & original, const key_set_t & edited)
+    {
+        size_t hits = 0;
+        for (const auto & key : edited) hits += original.contains(key);
+        return 100.0 * static_cast<double>(hits) / static_cast<double>(edited.size());
+    }
+}
+
+int main(const int argc, char ** argv)
+{
+    const size_t size = static_cast<size_t>((argc > 1 ? std::strtod(argv[1], nullptr) : 256) * 1024 * 1024);
+    fastcdc_t::params_t params;
+    if (argc > 4)
+    {
+        params.min_size = static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10) * 1024);
+        params.avg_size = static_cast<uint32_t>(std::strtoul(argv[3], nullptr, 10) * 1024);
+        params.max_size = static_cast<uint32_t>(std::strtoul(argv[4], nullptr, 10) * 1024);
+    }
+
+    const fastcdc_t chunker(params);
+    std::vector < uint8_t > data(size);
+    std::mt19937_64 rng(42);
+    for (auto & byte : data) byte = static_cast<uint8_t>(rng());
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto chunks = chunker.split(data.data(), data.size());
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("fastcdc %u/%u/%u KB: %.2f GB/s, %zu chunks, %.1f KB on average\n",
+        params.min_size / 1024, params.avg_size / 1024, params.max_size / 1024,
+        static_cast<double>(size) / seconds / 1e9, chunks.size(), static_cast<double>(size) / static_cast<double>(chunks.size()) / 1024);
+
+    auto edited = data;
+    edited.insert(edited.begin() + 1000, 0x5A);
+    std::printf("after a one byte insert, chunks already stored: fastcdc %.2f%%, fixed %.2f%%\n",
+        reused(keys_of(data, chunks), keys_of(edited, chunker.split(edited.data(), edited.size()))),
+        reused(keys_of(data, fixed_blocks(data.size())), keys_of(edited, fixed_blocks(edited.size()))));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/* crc64_bench.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Single core CRC64 throughput of every kernel the CPU supports, over buffer sizes from 64B to 1MB.
+ *
+ *   crc64_bench [MB per measurement] [file]
+ *
+ * With a file, also times crc64_file (all cores) against a single threaded pass. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "core/crc64sum.h"
+
+int main(const int argc, char ** argv)
+{
+    const double volume = (argc > 1 ? std::strtod(argv[1], nullptr) : 1024) * 1024 * 1024;
+    std::vector < uint8_t > data(1024 * 1024);
+    std::mt19937_64 rng(42);
+    for (auto & byte : data) byte = static_cast<uint8_t>(rng());
+
+    const char * names[] = { "table", "pclmul", "vpclmul" };
+    std::printf("active kernel: %s\n", names[CRC64::active_kernel()]);
+    for (const auto kernel : { CRC64::TABLE, CRC64::PCLMUL, CRC64::VPCLMUL })
+    {
+        if (!CRC64::kernel_supported(kernel)) {
+            std::printf("%-8s unsupported on this CPU\n", names[kernel]);
+            continue;
+        }
+
+        for (const size_t size : { 64ul, 512ul, 4096ul, 65536ul, 1048576ul })
+        {
+            const auto rounds = static_cast<size_t>(volume / static_cast<double>(size)) + 1;
+            uint64_t crc = 0xFFFFFFFFFFFFFFFF;
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < rounds; i++) {
+                crc = CRC64::update_with(kernel, crc, data.data(), size);
+            }
+
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::printf("%-8s %8zu B  %8.2f GB/s  (%016lx)\n", names[kernel], size,
+                static_cast<double>(rounds * size) / seconds / 1e9, crc);
+        }
+    }
+
+    if (argc > 2)
+    {
+        for (const unsigned threads : { 1u, 0u })
+        {
+            const auto start = std::chrono::steady_clock::now();
+            const uint64_t crc = crc64_file(argv[2], threads);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::printf("crc64_file (%s) %016lx in %.3fs\n", threads ? "1 thread" : "all cores", crc, seconds);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/* io_bench.cpp
+ *
+ * Copyright 2025 Anivice Ives
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Random 64KB block reads, old std::ifstream path against io_uring.
+ *
+ *   io_bench [directory] [blocks] [reads]
+ *
+ * ifstream and pread reach queue depth N with N threads doing blocking reads, io_uring reaches it
+ * with one thread submitting batches of N. The test file is a new temporary file in directory,
+ * removed again at the end. Its page cache is dropped before every run, point directory at the
+ * disk you want to measure. */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "helper/io_ring.h"
+
+constexpr uint32_t block_size = 64 * 1024;
+
+static void drop_cache(const int fd)
+{
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+template < typename Fn >
+static void report(const char * name, const unsigned depth, const size_t reads, Fn && fn)
+{
+    const auto start = std::chrono::steady_clock::now();
+    fn();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::printf("%-10s QD %-4u %10.0f IOPS %10.1f MB/s\n", name, depth, static_cast<double>(reads) / seconds,
+        static_cast<double>(reads) * block_size / seconds / 1024 / 1024);
+}
+
+// split reads over depth threads, each doing blocking I/O
+template < typename Fn >
+static void threaded(const std::vector < uint64_t > & offsets, const unsigned depth, Fn && read_one)
+{
+    std::vector < std::thread > threads;
+    for (unsigned t = 0; t < depth; t++)
+    {
+        threads.emplace_back([&, t] {
+            std::vector < char > buffer(block_size);
+            for (size_t i = t; i < offsets.size(); i += depth) {
+                read_one(offsets[i], buffer.data());
+            }
+        });
+    }
+
+    for (auto & thread : threads) {
+        thread.join();
+    }
+}
+
+int main(const int argc, char ** argv)
+{
+    const std::string directory = argc > 1 ? argv[1] : ".";
+    const uint64_t blocks = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4096;
+    const size_t reads = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 8192;
+
+    // never an existing file, the test file is overwritten and removed
+    std::string path = directory + "/io_bench.XXXXXX";
+    const int fd = mkostemp(path.data(), O_CLOEXEC);
+    if (fd == -1) {
+        std::perror(path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    {
+        std::vector < char > block(block_size);
+        std::mt19937_64 rng(42);
+        for (uint64_t i = 0; i < blocks; i++)
+        {
+            for (auto & c : block) c = static_cast<char>(rng());
+            if (pwrite(fd, block.data(), block_size, static_cast<off_t>(i * block_size)) != block_size) {
+                std::perror("pwrite");
+                close(fd);
+                unlink(path.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    std::vector < uint64_t > offsets(reads);
+    std::mt19937_64 rng(7);
+    for (auto & offset : offsets) offset = rng() % blocks * block_size;
+
+    io_ring_t ring;
+    const bool have_ring = ring.open(256);
+    std::printf("%lu reads of %u bytes over %lu blocks in %s%s\n", reads, block_size, blocks, path.c_str(),
+        have_ring ? "" : " (io_uring unavailable, io_uring rows use the blocking fallback)");
+
+    for (unsigned depth = 1; depth <= 256; depth *= 4)
+    {
+        drop_cache(fd);
+        report("ifstream", depth, reads, [&] {
+            threaded(offsets, depth, [&](const uint64_t offset, char * buffer) {
+                // what file_access.cpp did per block: open, seek, read, close
+                std::ifstream ifs(path, std::ios::binary);
+                ifs.seekg(static_cast<std::streamoff>(offset));
+                ifs.read(buffer, block_size);
+            });
+        });
+
+        drop_cache(fd);
+        report("pread", depth, reads, [&] {
+            threaded(offsets, depth, [&](const uint64_t offset, char * buffer) {
+                if (pread(fd, buffer, block_size, static_cast<off_t>(offset)) != block_size) std::abort();
+            });
+        });
+
+        drop_cache(fd);
+        report("io_uring", depth, reads, [&] {
+            std::vector < char > buffers(static_cast<size_t>(depth) * block_size);
+            std::vector < io_ring_t::request_t > requests(depth);
+            for (size_t done = 0; done < reads; done += depth)
+            {
+                const size_t count = std::min<size_t>(depth, reads - done);
+                for (size_t i = 0; i < count; i++) {
+                    requests[i] = { .opcode = io_ring_t::IO_READ, .fd = fd, .offset = offsets[done + i],
+                        .buffer = buffers.data() + i * block_size, .length = block_size };
+                }
+
+                ring.submit(requests.data(), count);
+                for (size_t i = 0; i < count; i++) {
+                    if (requests[i].result != block_size) std::abort();
+                }
+            }
+        });
+    }
+
+    ring.close();
+    close(fd);
+    unlink(path.c_str());
+    return EXIT_SUCCESS;
+}